@@ -8,6 +8,11 @@
 #include <string.h>
 #include <stdlib.h>
 
+#if defined (__SSE2__)
+	#include <emmintrin.h>
+	#define BLIP_SSE2 1
+#endif
+
 /* Library Copyright (C) 2003-2009 Shay Green. This library is free software;
 you can redistribute it and/or modify it under the terms of the GNU Lesser
 General Public License as published by the Free Software Foundation; either
@@ -67,7 +72,8 @@ struct blip_t
 	fixed_t offset;
 	int avail;
 	int size;
-	int integrator;
+	int channels;
+	int integrator [2];
 };
 
 typedef int buf_t;
@@ -110,22 +116,33 @@ static void check_assumptions( void )
 	assert( blip_max_frame <= (fixed_t) -1 >> time_bits );
 }
 
-blip_t* blip_new( int size )
+static blip_t* blip_new_channels( int size, int channels )
 {
 	blip_t* m;
 	assert( size >= 0 );
 	
-	m = (blip_t*) malloc( sizeof *m + (size + buf_extra) * sizeof (buf_t) );
+	m = (blip_t*) malloc( sizeof *m + (size + buf_extra) * channels * sizeof (buf_t) );
 	if ( m )
 	{
-		m->factor = time_unit / blip_max_ratio;
-		m->size   = size;
+		m->factor   = time_unit / blip_max_ratio;
+		m->size     = size;
+		m->channels = channels;
 		blip_clear( m );
 		check_assumptions();
 	}
 	return m;
 }
 
+blip_t* blip_new( int size )
+{
+	return blip_new_channels( size, 1 );
+}
+
+blip_t* blip_new_stereo( int size )
+{
+	return blip_new_channels( size, 2 );
+}
+
 void blip_delete( blip_t* m )
 {
 	if ( m != NULL )
@@ -163,8 +180,9 @@ void blip_clear( blip_t* m )
 	
 	m->offset     = m->factor / 2;
 	m->avail      = 0;
-	m->integrator = 0;
-	memset( SAMPLES( m ), 0, (m->size + buf_extra) * sizeof (buf_t) );
+	m->integrator [0] = 0;
+	m->integrator [1] = 0;
+	memset( SAMPLES( m ), 0, (m->size + buf_extra) * m->channels * sizeof (buf_t) );
 }
 
 int blip_clocks_needed( const blip_t* m, int samples )
@@ -207,8 +225,9 @@ int blip_samples_avail( const blip_t* m )
 static void remove_samples( blip_t* m, int count )
 {
 	buf_t* buf = SAMPLES( m );
-	int remain = m->avail + buf_extra - count;
+	int remain = (m->avail + buf_extra - count) * m->channels;
 	m->avail -= count;
+	count *= m->channels;
 	
 	memmove( &buf [0], &buf [count], remain * sizeof buf [0] );
 	memset( &buf [remain], 0, count * sizeof buf [0] );
@@ -217,6 +236,7 @@ static void remove_samples( blip_t* m, int count )
 int blip_read_samples( blip_t* m, short out [], int count, int stereo )
 {
 	assert( count >= 0 );
+	assert( m->channels == 1 );
 	
 	if ( count > m->avail )
 		count = m->avail;
@@ -226,7 +246,7 @@ int blip_read_samples( blip_t* m, short out [], int count, int stereo )
 		int const step = stereo ? 2 : 1;
 		buf_t const* in  = SAMPLES( m );
 		buf_t const* end = in + count;
-		int sum = m->integrator;
+		int sum = m->integrator [0];
 		do
 		{
 			/* Eliminate fraction */
@@ -244,7 +264,75 @@ int blip_read_samples( blip_t* m, short out [], int count, int stereo )
 			sum -= s << (delta_bits - bass_shift);
 		}
 		while ( in != end );
-		m->integrator = sum;
+		m->integrator [0] = sum;
+		
+		remove_samples( m, count );
+	}
+	
+	return count;
+}
+
+int blip_read_samples_stereo( blip_t* m, short out [], int count )
+{
+	assert( count >= 0 );
+	assert( m->channels == 2 );
+	
+	if ( count > m->avail )
+		count = m->avail;
+	
+	if ( count )
+	{
+		buf_t const* in  = SAMPLES( m );
+		buf_t const* end = in + count * 2;
+	#if defined (BLIP_SSE2) && BLIP_SSE2
+		/* Both channels are integrated at once in the two low lanes.
+		Saturating pack gives the same result as CLAMP. */
+		__m128i sum = _mm_set_epi32( 0, 0, m->integrator [1], m->integrator [0] );
+		do
+		{
+			__m128i s = _mm_srai_epi32( sum, delta_bits );
+			int pair;
+			
+			sum = _mm_add_epi32( sum, _mm_loadl_epi64( (__m128i const*) in ) );
+			in += 2;
+			
+			s = _mm_packs_epi32( s, s );
+			pair = _mm_cvtsi128_si32( s );
+			memcpy( out, &pair, sizeof pair );
+			out += 2;
+			
+			s = _mm_srai_epi32( _mm_unpacklo_epi16( s, s ), 16 );
+			sum = _mm_sub_epi32( sum, _mm_slli_epi32( s, delta_bits - bass_shift ) );
+		}
+		while ( in != end );
+		m->integrator [0] = _mm_cvtsi128_si32( sum );
+		m->integrator [1] = _mm_cvtsi128_si32( _mm_srli_si128( sum, 4 ) );
+	#else
+		int left  = m->integrator [0];
+		int right = m->integrator [1];
+		do
+		{
+			int l = ARITH_SHIFT( left,  delta_bits );
+			int r = ARITH_SHIFT( right, delta_bits );
+			
+			left  += in [0];
+			right += in [1];
+			in += 2;
+			
+			CLAMP( l );
+			CLAMP( r );
+			
+			out [0] = l;
+			out [1] = r;
+			out += 2;
+			
+			left  -= l << (delta_bits - bass_shift);
+			right -= r << (delta_bits - bass_shift);
+		}
+		while ( in != end );
+		m->integrator [0] = left;
+		m->integrator [1] = right;
+	#endif
 		
 		remove_samples( m, count );
 	}
@@ -342,6 +430,43 @@ void blip_add_delta( blip_t* m, unsigned time, int delta )
 	out [15] += in[0]*delta + in[0-half_width]*delta2;
 }
 
+void blip_add_delta_stereo( blip_t* m, unsigned time, int left, int right )
+{
+	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
+	buf_t* out = SAMPLES( m ) + (m->avail + (fixed >> frac_bits)) * 2;
+	
+	int const phase_shift = frac_bits - phase_bits;
+	int phase = fixed >> phase_shift & (phase_count - 1);
+	short const* in  = bl_step [phase];
+	short const* rev = bl_step [phase_count - phase];
+	
+	int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
+	int left2  = (left  * interp) >> delta_bits;
+	int right2 = (right * interp) >> delta_bits;
+	int i;
+	left  -= left2;
+	right -= right2;
+	
+	/* same overflow hack as blip_add_delta() */
+	if (!( out <= &SAMPLES( m ) [(m->size + end_frame_extra) * 2] )) {
+		return;
+	}
+	
+	for ( i = 0; i < half_width; i++ )
+	{
+		out [i*2+0] += in[i]*left  + in[half_width+i]*left2;
+		out [i*2+1] += in[i]*right + in[half_width+i]*right2;
+	}
+	
+	in = rev;
+	out += half_width * 2;
+	for ( i = 0; i < half_width; i++ )
+	{
+		out [i*2+0] += in[7-i]*left  + in[7-i-half_width]*left2;
+		out [i*2+1] += in[7-i]*right + in[7-i-half_width]*right2;
+	}
+}
+
 void blip_add_delta_fast( blip_t* m, unsigned time, int delta )
 {
 	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
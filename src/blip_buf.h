@@ -62,6 +62,23 @@ int blip_read_samples( blip_t*, short out [], int count, int stereo );
 void blip_delete( blip_t* );
 
 
+/* Stereo extension */
+
+/** Creates new stereo buffer: left and right samples are interleaved in a
+single buffer sharing rates and time frames, so that blip_end_frame(),
+blip_clear(), blip_clocks_needed() and blip_samples_avail() handle both
+channels at once. */
+blip_t* blip_new_stereo( int sample_count );
+
+/** Adds left and right deltas into stereo buffer at specified clock time. */
+void blip_add_delta_stereo( blip_t*, unsigned int clock_time, int left, int right );
+
+/** Reads and removes at most 'count' stereo samples from stereo buffer and
+writes them interleaved (left, right) to 'out'. Returns number of stereo
+samples actually read. */
+int blip_read_samples_stereo( blip_t*, short out [], int count );
+
+
 /* Deprecated */
 typedef blip_t blip_buffer_t;
 
@@ -7,7 +7,7 @@
 
 #define DIVIDER_CYCLES (CLOCK_SPEED_HZ / 16384)
 
-static struct
+static GBOYEMU_STATE struct
 {
 	uint32_t cycles;
 	uint8_t counter;
@@ -32,6 +32,12 @@ void divider_set_counter(uint8_t counter)
 	divider.counter = 0;
 }
 
+uint32_t divider_sequencer_cycles(void)
+{
+	return DIVIDER_SEQUENCER_CYCLES
+		- ((divider.counter & 0x1F) * DIVIDER_CYCLES + divider.cycles);
+}
+
 void divider_update(uint32_t cycles)
 {
 	divider.cycles += cycles;
@@ -7,6 +7,12 @@ void divider_update(uint32_t cycles);
 uint8_t divider_get_counter(void);
 void divider_set_counter(uint8_t counter);
 
+/* APU frame sequencer is clocked at 512 Hz by the falling
+ * edge of divider bit 4: cycles left before next edge
+ */
+#define DIVIDER_SEQUENCER_CYCLES (CLOCK_SPEED_HZ / 512)
+uint32_t divider_sequencer_cycles(void);
+
 int32_t divider_dump(FILE *file);
 int32_t divider_restore(FILE *file);
 
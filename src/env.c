@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include "gboyemu.h"
+#include "env.h"
+#include "rom.h"
+#include "z80.h"
+#include "mmu.h"
+#include "gpu.h"
+#include "divider.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "joypad.h"
+#include "sound.h"
+#include "serial.h"
+
+static GBOYEMU_STATE struct
+{
+	char rom_filename[PATH_MAX];
+
+	struct
+	{
+		uint16_t addr[ENV_MAX_WATCHES];
+		int32_t weight[ENV_MAX_WATCHES];
+		uint8_t prev[ENV_MAX_WATCHES];
+		uint8_t cur[ENV_MAX_WATCHES];
+		uint32_t count;
+		env_reward_hook hook;
+		void *opaque;
+	} watch;
+} env;
+
+static void env_read_watches(uint8_t *values)
+{
+	uint32_t i;
+	for ( i = 0; i < env.watch.count; i++ )
+		values[i] = mmu_read_mem8(env.watch.addr[i]);
+}
+
+int32_t env_reset(void)
+{
+	if ( z80_init() < 0 )
+	{
+		fprintf(stderr, "Could not initialize z80.\n");
+		return -1;
+	}
+
+	if ( mmu_init() < 0 )
+	{
+		fprintf(stderr, "Could not initialize mmu.\n");
+		return -1;
+	}
+
+	if ( gpu_init(1, 1) < 0 )
+	{
+		fprintf(stderr, "Could not initialize gpu.\n");
+		return -1;
+	}
+
+	sound_cleanup();
+	if ( sound_init(SOUND_SINK_NULL, NULL) < 0 )
+	{
+		fprintf(stderr, "Could not initialize sound.\n");
+		return -1;
+	}
+
+	if ( divider_init() < 0 )
+	{
+		fprintf(stderr, "Could not initialize divider.\n");
+		return -1;
+	}
+
+	if ( interrupt_init() < 0 )
+	{
+		fprintf(stderr, "Could not initialize interrupt.\n");
+		return -1;
+	}
+
+	if ( timer_init() < 0 )
+	{
+		fprintf(stderr, "Could not initialize timer.\n");
+		return -1;
+	}
+
+	if ( joypad_init() < 0 )
+	{
+		fprintf(stderr, "Could not initialize joypad.\n");
+		return -1;
+	}
+
+	if ( serial_init() < 0 )
+	{
+		fprintf(stderr, "Could not initialize serial.\n");
+		return -1;
+	}
+
+	if ( rom_load(env.rom_filename) < 0 )
+	{
+		fprintf(stderr, "Could not load rom.\n");
+		return -1;
+	}
+
+	env_read_watches(env.watch.prev);
+
+	return 0;
+}
+
+int32_t env_init(const char *rom_filename)
+{
+	memset(&env, 0, sizeof(env));
+	snprintf(env.rom_filename, sizeof(env.rom_filename), "%s", rom_filename);
+	return env_reset();
+}
+
+void env_cleanup(void)
+{
+	sound_cleanup();
+	rom_unload();
+}
+
+int32_t env_watch(uint16_t addr, int32_t weight)
+{
+	if ( env.watch.count >= ENV_MAX_WATCHES )
+		return -1;
+
+	env.watch.addr[env.watch.count] = addr;
+	env.watch.weight[env.watch.count] = weight;
+	env.watch.prev[env.watch.count] = mmu_read_mem8(addr);
+	env.watch.count++;
+
+	return 0;
+}
+
+void env_set_reward_hook(env_reward_hook hook, void *opaque)
+{
+	env.watch.hook = hook;
+	env.watch.opaque = opaque;
+}
+
+static int32_t env_reward(void)
+{
+	int32_t reward;
+	uint32_t i;
+
+	env_read_watches(env.watch.cur);
+
+	if ( env.watch.hook != NULL )
+	{
+		reward = env.watch.hook(env.watch.prev, env.watch.cur,
+			env.watch.count, env.watch.opaque);
+	}
+	else
+	{
+		reward = 0;
+		for ( i = 0; i < env.watch.count; i++ )
+			reward += env.watch.weight[i] * ((int32_t)env.watch.cur[i] - env.watch.prev[i]);
+	}
+
+	memcpy(env.watch.prev, env.watch.cur, env.watch.count);
+
+	return reward;
+}
+
+/* run until the gpu completes a frame, or a frame worth
+ * of cycles when the LCD is off. frame_skip: next frame
+ * does not need to be rendered.
+ */
+static uint32_t env_run_frame(uint32_t frame_skip)
+{
+	uint32_t cycles, frame_cycles;
+	uint32_t vblank;
+
+	frame_cycles = 0;
+	vblank = 0;
+	while ( vblank == 0 && frame_cycles < GPU_CYCLES_FULL )
+	{
+		if ( z80_stopped() )
+		{
+			sound_sync();
+			return 0;
+		}
+
+		interrupt_run();
+
+		cycles = z80_next_opcode(0);
+		frame_cycles += cycles;
+
+		timer_update(cycles);
+		divider_update(cycles);
+		sound_run(cycles);
+		vblank = gpu_run(cycles, frame_skip);
+	}
+	sound_sync();
+
+	return 1;
+}
+
+uint32_t env_step(uint8_t buttons, uint32_t frames, uint8_t *observation,
+	enum gpu_screen_format format, int32_t *reward)
+{
+	uint32_t f, count;
+	int32_t r;
+
+	if ( joypad_set_keys(buttons) )
+		z80_resume_stop();
+
+	/* only the screen at the end of the step is observed:
+	 * frames before that one are not rendered
+	 */
+	count = 0;
+	for ( f = 0; f < frames; f++ )
+		count += env_run_frame(observation == NULL || f + 1 < frames);
+
+	if ( observation != NULL )
+		gpu_copy_screen(observation, format);
+
+	/* always consume watched values, so that
+	 * reward only covers the current step
+	 */
+	r = env_reward();
+	if ( reward != NULL )
+		*reward = r;
+
+	return count;
+}
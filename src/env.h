@@ -0,0 +1,34 @@
+#ifndef _ENV_H_
+#define _ENV_H_
+
+#include "gpu.h"
+
+/* Headless environment: drives the emulator programmatically
+ * (agents, scripts, tests) without any SDL call.
+ */
+
+#define ENV_OBSERVATION_SIZE (GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT)
+
+int32_t env_init(const char *rom_filename);
+int32_t env_reset(void);
+void env_cleanup(void);
+
+/* reward is computed from watched memory bytes (work ram, high ram...).
+ * default reward is the weighted sum of watched bytes variations
+ * during a step, unless a hook is set.
+ */
+#define ENV_MAX_WATCHES 32
+typedef int32_t (*env_reward_hook)(const uint8_t *prev, const uint8_t *cur,
+	uint32_t count, void *opaque);
+
+int32_t env_watch(uint16_t addr, int32_t weight);
+void env_set_reward_hook(env_reward_hook hook, void *opaque);
+
+/* run frames with buttons (JOYPAD_KEY_* bits) held.
+ * observation (ENV_OBSERVATION_SIZE bytes) and reward may be NULL.
+ * return the number of frames run.
+ */
+uint32_t env_step(uint8_t buttons, uint32_t frames, uint8_t *observation,
+	enum gpu_screen_format format, int32_t *reward);
+
+#endif
@@ -1,11 +1,17 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <pwd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <SDL.h>
 #include "gboyemu.h"
 #include "rom.h"
@@ -18,11 +24,17 @@
 #include "joypad.h"
 #include "sound.h"
 #include "serial.h"
+#include "movie.h"
 
 #define CONF_DIR ".gboyemu"
 #define DUMP_DIR "dump"
 #define SYNC_PERIOD_MS ((GPU_CYCLES_FULL * 1000) / CLOCK_SPEED_HZ)
 
+/* frame skip policy: render 1 frame out of n+1, or
+ * skip frames only while late on wall clock
+ */
+#define FRAME_SKIP_AUTO UINT32_MAX
+
 static char dump_dir[PATH_MAX];
 
 static struct
@@ -30,10 +42,70 @@ static struct
 	uint32_t accurate;
 	uint32_t time;
 	uint32_t disassemble;
-	uint32_t sync_cycles;
 	uint32_t delayed;
+	uint64_t emulated_cycles;
+
+	/* deterministic mode: no frame skipping, inputs latched
+	 * for whole frames
+	 */
+	uint32_t deterministic;
+
+	/* frames run so far, and host keys latched for next frame
+	 * (deterministic mode only)
+	 */
+	uint32_t frame;
+	uint32_t keys;
+
+	/* no SDL at all: movie playback only
+	 */
+	uint32_t headless;
+
+	/* emulation speed multiplier, 0 is unlimited. turbo key
+	 * switches to unlimited until pressed again
+	 */
+	uint32_t speed;
+	uint32_t turbo;
+	uint32_t skip_policy;
+	uint32_t frame_skip;
+	uint32_t presented;
+
+	/* window caption, set by main thread
+	 */
+	char title[64];
 } gboyemu;
 
+/* SDL video and events are only handled by the main thread, while
+ * emulation runs in its own thread, so that display never delays it.
+ * input events are queued by main thread and handled by emulation
+ * thread between frames.
+ */
+#define EVENTS_MAX 64
+
+static struct
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	SDL_Event events[EVENTS_MAX];
+	uint32_t count;
+	atomic_uint quit;
+	/* emulation thread is initialized, status is valid
+	 */
+	sem_t started;
+	int32_t status;
+} emulation = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* command line, given to emulation thread
+ */
+struct gboyemu_options
+{
+	uint32_t deterministic;
+	uint32_t speed;
+	uint32_t skip_policy;
+	uint32_t skip_set;
+	const char *record, *play, *audio;
+	const char *rom;
+};
+
 static int32_t create_dir(const char *dir)
 {
 	struct stat buf;
@@ -292,17 +364,160 @@ static uint32_t gboyemu_accurate_delays(void)
 	return accurate;
 }
 
-int32_t gboyemu_init(void)
+static uint32_t gboyemu_speed(void)
 {
-	if ( check_conf_dir() < 0 )
+	return gboyemu.turbo ? 0 : gboyemu.speed;
+}
+
+static void gboyemu_speed_changed(void)
+{
+	/* no time stretching: above normal speed audio is muted
+	 */
+	sound_mute(gboyemu_speed() != 1);
+
+	gboyemu.time = SDL_GetTicks();
+	gboyemu.emulated_cycles = 0;
+	gboyemu.delayed = 0;
+
+	if ( gboyemu_speed() == 0 )
+		fprintf(stderr, "Speed: unlimited\n");
+	else
+		fprintf(stderr, "Speed: %ux\n", gboyemu_speed());
+}
+
+/* called when a frame is complete: decide if next one
+ * has to be rendered. when running faster than real time,
+ * only render as many frames as a real gameboy would show.
+ */
+static void gboyemu_next_frame(void)
+{
+	uint32_t speed, now;
+
+	if ( gboyemu.skip_policy == FRAME_SKIP_AUTO )
+		gboyemu.frame_skip = (gboyemu.delayed >= SYNC_PERIOD_MS);
+	else
+		gboyemu.frame_skip = ((gboyemu.frame % (gboyemu.skip_policy + 1)) != 0);
+
+	speed = gboyemu_speed();
+	if ( speed > 1 )
+		gboyemu.frame_skip |= ((gboyemu.frame % speed) != 0);
+	else if ( speed == 0 && gboyemu.frame_skip == 0 )
 	{
-		fprintf(stderr, "Could not check configuration directory\n");
-		return -1;
+		now = SDL_GetTicks();
+		gboyemu.frame_skip = (now - gboyemu.presented < SYNC_PERIOD_MS);
+		if ( gboyemu.frame_skip == 0 )
+			gboyemu.presented = now;
 	}
+}
 
-	if ( SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0 )
+/* pacing: sleep until wall clock reaches emulated time.
+ * wall clock never changes what gets emulated, only when.
+ */
+static void gboyemu_pace(uint32_t cycles)
+{
+	uint32_t now, target, speed;
+
+	speed = gboyemu_speed();
+	if ( speed == 0 )
+		return;
+
+	gboyemu.emulated_cycles += cycles;
+	target = gboyemu.time + (uint32_t)((gboyemu.emulated_cycles * 1000) / ((uint64_t)CLOCK_SPEED_HZ * speed));
+	now = SDL_GetTicks();
+
+	/* how late we are, for adaptive frame skip
+	 */
+	gboyemu.delayed = 0;
+
+	if ( (int32_t)(target - now) > 0 )
+		SDL_Delay(target - now);
+	else if ( now - target <= SYNC_PERIOD_MS * 10 )
+		gboyemu.delayed = now - target;
+	else
 	{
-		fprintf(stderr, "Could not initialize SDL: %s\n", SDL_GetError());
+		/* too far behind (slow host, debugger...): restart
+		 * from now rather than running flat out to catch up
+		 */
+		gboyemu.time = now;
+		gboyemu.emulated_cycles = 0;
+	}
+}
+
+/* run until the gpu enters VBLANK, or a frame worth
+ * of cycles when the LCD is off (or the cpu is stopped).
+ * return -1 once the movie being played is over.
+ */
+static int32_t gboyemu_run_frame(void)
+{
+	uint32_t cycles, frame_cycles;
+	uint32_t vblank;
+	uint32_t keys;
+
+	/* deterministic mode: inputs are latched for the
+	 * whole frame (from host keys or from movie)
+	 */
+	if ( gboyemu.deterministic )
+	{
+		keys = gboyemu.keys;
+		if ( movie_frame(gboyemu.frame, &keys) < 0 )
+			return -1;
+		if ( joypad_set_keys(keys) )
+			z80_resume_stop();
+	}
+	gboyemu.frame++;
+
+	frame_cycles = 0;
+	vblank = 0;
+	if ( z80_stopped() )
+		frame_cycles = GPU_CYCLES_FULL;
+
+	while ( vblank == 0 && frame_cycles < GPU_CYCLES_FULL && z80_stopped() == 0 )
+	{
+		interrupt_run();
+
+		cycles = z80_next_opcode(gboyemu.disassemble);
+		frame_cycles += cycles;
+
+		timer_update(cycles);
+		divider_update(cycles);
+		sound_run(cycles);
+		vblank = gpu_run(cycles, gboyemu.frame_skip);
+	}
+	sound_sync();
+
+	if ( gboyemu.headless == 0 )
+	{
+		gboyemu_pace(frame_cycles);
+		gboyemu_next_frame();
+	}
+
+	return 0;
+}
+
+/* FNV-1a hash of the current screen (shade indices)
+ */
+static uint64_t gboyemu_screen_hash(void)
+{
+	uint8_t screen[GB_SCREEN_HEIGHT * GB_SCREEN_WIDTH];
+	uint64_t hash;
+	uint32_t i;
+
+	gpu_copy_screen(screen, GPU_SCREEN_INDEX);
+
+	hash = 0xCBF29CE484222325ULL;
+	for ( i = 0; i < sizeof(screen); i++ )
+		hash = (hash ^ screen[i]) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+int32_t gboyemu_init(uint32_t headless, const char *audio)
+{
+	enum sound_sink sink;
+
+	if ( check_conf_dir() < 0 )
+	{
+		fprintf(stderr, "Could not check configuration directory\n");
 		return -1;
 	}
 
@@ -318,13 +533,20 @@ int32_t gboyemu_init(void)
 		return -1;
 	}
 
-	if ( gpu_init(0) < 0 )
+	if ( gpu_init(0, headless) < 0 )
 	{
 		fprintf(stderr, "Could not initialize gpu. exiting.\n");
 		return -1;
 	}
 
-	if ( sound_init() < 0 )
+	/* audio file replaces the device, headless or not
+	 */
+	if ( audio != NULL )
+		sink = SOUND_SINK_FILE;
+	else
+		sink = (headless) ? SOUND_SINK_NULL : SOUND_SINK_SDL;
+
+	if ( sound_init(sink, audio) < 0 )
 	{
 		fprintf(stderr, "Could not initialize sound. exiting.\n");
 		return -1;
@@ -361,7 +583,9 @@ int32_t gboyemu_init(void)
 	}
 
 	memset(&gboyemu, 0, sizeof(gboyemu));
-	gboyemu.accurate = gboyemu_accurate_delays();
+	gboyemu.headless = headless;
+	if ( headless == 0 )
+		gboyemu.accurate = gboyemu_accurate_delays();
 	gboyemu.disassemble = 0;
 	sound_start();
 
@@ -371,102 +595,307 @@ int32_t gboyemu_init(void)
 void gboyemu_cleanup(void)
 {
 	sound_stop();
-
-	SDL_Quit();
+	sound_cleanup();
+	rom_unload();
 	fprintf(stderr, "GoodBye!\n");
 }
 
 int32_t gboyemu_load_rom(const char *rom_filename)
 {
-	char title[64];
 	if ( rom_load(rom_filename) < 0 )
 	{
 		fprintf(stderr, "Could not load rom. exiting.\n");
 		return -1;
 	}
 
-	snprintf(title, sizeof(title), "GBOYEMU - %s", rom_get_title());
-	title[sizeof(title) - 1] = '\0';
-	SDL_WM_SetCaption(title, NULL);
+	if ( gboyemu.headless )
+		return 0;
+
+	snprintf(gboyemu.title, sizeof(gboyemu.title), "GBOYEMU - %s", rom_get_title());
+	gboyemu.title[sizeof(gboyemu.title) - 1] = '\0';
 
 	return 0;
 }
 
+/* init, load ROM and open movies, in the thread that runs emulation
+ */
+static int32_t gboyemu_start(uint32_t headless, const struct gboyemu_options *options)
+{
+	uint32_t skip_policy;
+
+	if ( gboyemu_init(headless, options->audio) < 0 )
+		return -1;
+
+	if ( gboyemu_load_rom(options->rom) < 0 )
+		goto error;
+
+	/* movies only make sense with inputs latched on frames
+	 */
+	if ( options->record != NULL && movie_record(options->record, rom_get_title()) < 0 )
+		goto error;
+	if ( options->play != NULL && movie_play(options->play, rom_get_title()) < 0 )
+		goto error;
+	gboyemu.deterministic = options->deterministic || options->record || options->play;
+
+	/* wall clock does not decide which frames are rendered in
+	 * deterministic mode, unless explicitly asked
+	 */
+	skip_policy = options->skip_policy;
+	if ( gboyemu.deterministic && options->skip_set == 0 )
+		skip_policy = 0;
+	gboyemu.skip_policy = skip_policy;
+
+	return 0;
+
+  error:
+	gboyemu_cleanup();
+	return -1;
+}
+
+/* keys (emulation thread)
+ */
+static void gboyemu_handle_event(const SDL_Event *event)
+{
+	switch ( event->type )
+	{
+		case SDL_KEYDOWN:
+		if ( event->key.keysym.sym == SDLK_F10 )
+		{
+			gboyemu.disassemble = !gboyemu.disassemble;
+		}
+		else if ( event->key.keysym.sym == SDLK_F1 )
+		{
+			if ( movie_recording() || movie_playing() )
+				fprintf(stderr, "Can't restore while a movie is running\n");
+			else
+				gboyemu_restore();
+		}
+		else if ( event->key.keysym.sym == SDLK_F2 )
+		{
+			gboyemu_dump();
+		}
+		else if ( event->key.keysym.sym == SDLK_TAB )
+		{
+			gboyemu.turbo = !gboyemu.turbo;
+			gboyemu_speed_changed();
+		}
+		else if ( event->key.keysym.sym == SDLK_KP_PLUS )
+		{
+			if ( gpu_get_zoom() < GPU_ZOOM_MAX )
+			gpu_set_zoom(gpu_get_zoom() + 1);
+		}
+		else if ( event->key.keysym.sym == SDLK_KP_MINUS )
+		{
+			if ( gpu_get_zoom() > 1 )
+				gpu_set_zoom(gpu_get_zoom() - 1);
+		}
+		else if ( gboyemu.deterministic )
+		{
+			gboyemu.keys |= joypad_sdl_key(event->key.keysym.sym);
+		}
+		else
+		{
+			if ( joypad_handle_key(event->key.keysym.sym, 1) )
+				z80_resume_stop();
+		}
+		break;
+
+		case SDL_KEYUP:
+		if ( gboyemu.deterministic )
+			gboyemu.keys &= ~joypad_sdl_key(event->key.keysym.sym);
+		else
+			joypad_handle_key(event->key.keysym.sym, 0);
+		break;
+
+		default:
+		break;
+	}
+}
+
+static void *gboyemu_emulation_thread(void *arg)
+{
+	const struct gboyemu_options *options = arg;
+	SDL_Event events[EVENTS_MAX];
+	uint32_t count, i;
+
+	emulation.status = gboyemu_start(0, options);
+	sem_post(&emulation.started);
+	if ( emulation.status < 0 )
+		return NULL;
+
+	gboyemu.speed = options->speed;
+	gboyemu_speed_changed();
+
+	while ( atomic_load(&emulation.quit) == 0 )
+	{
+		/* one frame of emulation, then input and
+		 * pacing are handled once per frame
+		 */
+		if ( gboyemu_run_frame() < 0 )
+		{
+			fprintf(stderr, "End of movie\n");
+			movie_stop(gboyemu.frame);
+		}
+
+		pthread_mutex_lock(&emulation.lock);
+		count = emulation.count;
+		memcpy(events, emulation.events, count * sizeof(events[0]));
+		emulation.count = 0;
+		pthread_mutex_unlock(&emulation.lock);
+
+		for ( i = 0; i < count; i++ )
+			gboyemu_handle_event(&events[i]);
+	}
+
+	movie_stop(gboyemu.frame);
+	gboyemu_cleanup();
+
+	return NULL;
+}
+
+/* hand event over to emulation thread, dropped if it is
+ * too far behind
+ */
+static void gboyemu_queue_event(const SDL_Event *event)
+{
+	pthread_mutex_lock(&emulation.lock);
+	if ( emulation.count < EVENTS_MAX )
+		emulation.events[emulation.count++] = *event;
+	pthread_mutex_unlock(&emulation.lock);
+}
+
 int32_t main(int32_t argc, const char **argv)
 {
         SDL_Event event;
-	uint32_t cycles;
-	uint32_t i, frame_skip;
 	uint32_t run = 1;
-	uint32_t delay, time2sleep;
+	uint32_t headless = 0;
+	char *end;
+	uint32_t usage = 0;
+	struct gboyemu_options cmdline =
+	{
+		.speed = 1,
+		.skip_policy = FRAME_SKIP_AUTO,
+	};
+	int32_t opt;
+	static const struct option options[] =
+	{
+		{ "deterministic", no_argument, NULL, 'd' },
+		{ "record", required_argument, NULL, 'r' },
+		{ "play", required_argument, NULL, 'p' },
+		{ "headless", no_argument, NULL, 'H' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "frame-skip", required_argument, NULL, 'f' },
+		{ "audio", required_argument, NULL, 'a' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	while ( (opt = getopt_long(argc, (char * const *)argv, "dr:p:Hs:f:a:", options, NULL)) != -1 )
+	{
+		switch ( opt )
+		{
+			case 'd':
+			cmdline.deterministic = 1;
+			break;
+
+			case 'r':
+			cmdline.record = optarg;
+			break;
+
+			case 'p':
+			cmdline.play = optarg;
+			break;
+
+			case 'H':
+			headless = 1;
+			break;
+
+			case 's':
+			cmdline.speed = strtoul(optarg, &end, 10);
+			if ( *optarg == '\0' || *end != '\0' )
+				usage = 1;
+			break;
+
+			case 'f':
+			cmdline.skip_set = 1;
+			if ( strcmp(optarg, "auto") == 0 )
+				break;
+			cmdline.skip_policy = strtoul(optarg, &end, 10);
+			if ( *optarg == '\0' || *end != '\0' )
+				usage = 1;
+			break;
+
+			case 'a':
+			cmdline.audio = optarg;
+			break;
+
+			default:
+			usage = 1;
+			break;
+		}
+	}
+
+	if ( (cmdline.record && cmdline.play) || (headless && cmdline.play == NULL) )
+		usage = 1;
+
+	if ( usage || optind != argc - 1 )
+	{
+		fprintf(stderr, "Usage: %s [-d|--deterministic] [-r|--record <movie>] [-p|--play <movie> [-H|--headless]] [-s|--speed <n>] [-f|--frame-skip <n|auto>] [-a|--audio <file>] <rom>\n", argv[0]);
+		return -1;
+	}
+
+	cmdline.rom = argv[optind];
+
+	if ( headless )
+	{
+		if ( gboyemu_start(headless, &cmdline) < 0 )
+			return -1;
+
+		/* replay as fast as possible, then print a summary
+		 * that can be compared between runs
+		 */
+		while ( gboyemu_run_frame() == 0 )
+			;
+		movie_stop(gboyemu.frame);
+		printf("%u frames, screen hash %016llX\n", gboyemu.frame,
+			(unsigned long long)gboyemu_screen_hash());
+		gboyemu_cleanup();
+		return 0;
+	}
 
-	if ( argc != 2 )
+	if ( SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0 )
 	{
-		fprintf(stderr, "Usage: %s <rom>\n", argv[0]);
+		fprintf(stderr, "Could not initialize SDL: %s\n", SDL_GetError());
 		return -1;
 	}
 
-	if ( gboyemu_init() < 0 )
+	if ( gpu_open_screen() < 0 )
+	{
+		fprintf(stderr, "Could not open screen. exiting.\n");
+		SDL_Quit();
 		return -1;
+	}
 
-	if ( gboyemu_load_rom(argv[1]) < 0 )
+	if ( sem_init(&emulation.started, 0, 0) < 0
+		|| pthread_create(&emulation.thread, NULL, gboyemu_emulation_thread, &cmdline) != 0 )
+	{
+		fprintf(stderr, "Could not start emulation thread. exiting.\n");
+		gpu_close_screen();
+		SDL_Quit();
 		return -1;
+	}
 
-	gboyemu.time = SDL_GetTicks();
+	sem_wait(&emulation.started);
+	if ( emulation.status < 0 )
+		run = 0;
+	else
+		SDL_WM_SetCaption(gboyemu.title, NULL);
 
 	while ( run )
 	{
-		if ( z80_stopped() == 0 )
-		{
-			for ( i = 0; i < 10; i++ )
-			{
-				interrupt_run();
-
-				cycles = z80_next_opcode(gboyemu.disassemble);
-				gboyemu.sync_cycles += cycles;
-
-				timer_update(cycles);
-				divider_update(cycles);
-				sound_run(cycles);
-				if ( gboyemu.delayed >= SYNC_PERIOD_MS )
-					frame_skip = 1;
-				else
-					frame_skip = 0;
-				gpu_run(cycles, frame_skip);
-			}
-
-			if ( gboyemu.sync_cycles >= (CLOCK_SPEED_HZ / 1000) * SYNC_PERIOD_MS )
-			{
-				delay = SDL_GetTicks() - gboyemu.time;
-				if ( delay < SYNC_PERIOD_MS )
-				{
-					time2sleep = SYNC_PERIOD_MS - delay;
-					if ( gboyemu.delayed > 0 )
-					{
-						if ( gboyemu.delayed > time2sleep )
-						{
-							gboyemu.delayed -= time2sleep;
-							time2sleep = 0;
-						}
-						else
-						{
-							time2sleep -= gboyemu.delayed;
-							gboyemu.delayed = 0;
-						}
-					}
-
-					if ( time2sleep > 0 )
-						SDL_Delay(time2sleep);
-				}
-				else
-				{
-					gboyemu.delayed += delay - SYNC_PERIOD_MS;
-				}
-
-				gboyemu.time = SDL_GetTicks();
-				gboyemu.sync_cycles = 0;
-			}
-		}
+		/* display latest frame, then pass input on to
+		 * emulation thread
+		 */
+		gpu_show(SYNC_PERIOD_MS);
 
 		while ( SDL_PollEvent(&event) )
 		{
@@ -477,45 +906,21 @@ int32_t main(int32_t argc, const char **argv)
 				break;
 
 				case SDL_KEYDOWN:
-				if ( event.key.keysym.sym == SDLK_F10 )
-				{
-					gboyemu.disassemble = !gboyemu.disassemble;
-				}
-				else if ( event.key.keysym.sym == SDLK_F1 )
-				{
-					gboyemu_restore();
-				}
-				else if ( event.key.keysym.sym == SDLK_F2 )
-				{
-					gboyemu_dump();
-				}
-				else if ( event.key.keysym.sym == SDLK_KP_PLUS )
-				{
-					if ( gpu_get_zoom() < GPU_ZOOM_MAX )
-					gpu_set_zoom(gpu_get_zoom() + 1);
-				}
-				else if ( event.key.keysym.sym == SDLK_KP_MINUS )
-				{
-					if ( gpu_get_zoom() > 1 )
-						gpu_set_zoom(gpu_get_zoom() - 1);
-				}
-				else
-				{
-					if ( joypad_handle_key(event.key.keysym.sym, 1) )
-						z80_resume_stop();
-				}
-				break;
-
 				case SDL_KEYUP:
-				joypad_handle_key(event.key.keysym.sym, 0);
+				gboyemu_queue_event(&event);
 				break;
 
 				default:
 				break;
 			}
 		}
-
 	}
 
-	return 0;
+	atomic_store(&emulation.quit, 1);
+	pthread_join(emulation.thread, NULL);
+	sem_destroy(&emulation.started);
+	gpu_close_screen();
+	SDL_Quit();
+
+	return (emulation.status < 0) ? -1 : 0;
 }
@@ -3,7 +3,12 @@
 
 #define CLOCK_SPEED_HZ 4194304
 
-int32_t gboyemu_init(void);
+/* emulator state is thread local: each thread runs
+ * its own instance (see vecenv.c)
+ */
+#define GBOYEMU_STATE __thread
+
+int32_t gboyemu_init(uint32_t headless, const char *audio);
 void gboyemu_cleanup(void);
 int32_t gboyemu_load_rom(const char *rom_filename);
 uint32_t gboyemu_run(void);
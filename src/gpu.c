@@ -1,7 +1,16 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 #include <SDL.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define GPU_SSSE3
+#endif
+#include "gboyemu.h"
 #include "gpu.h"
 #include "mmu.h"
 #include "interrupt.h"
@@ -27,6 +36,68 @@ static SDL_Surface *screen = NULL;
 static SDL_Surface *gb_surface = NULL;
 static SDL_Rect screen_rect;
 
+/* frame being rendered, at 1x: each pixel is a color number (bits 0-1)
+ * tagged with the palette it goes through (bits 2-3). palette registers
+ * are saved for every rendered line, colors are only computed when the
+ * frame is presented (scaled to gb_surface) or copied out.
+ */
+#define GPU_PAL_BG    0
+#define GPU_PAL_OBJ0  1
+#define GPU_PAL_OBJ1  2
+#define GPU_PAL_BLANK 3	/* white whatever the color number */
+#define GPU_PALETTES  4
+#define GPU_PIXEL(pal, color) (((pal) << 2) | (color))
+#define GPU_PIXEL_BLANK GPU_PIXEL(GPU_PAL_BLANK, 0)
+/* only background/window color 0 lets sprites behind it show through
+ */
+#define GPU_PIXEL_TRANSPARENT GPU_PIXEL(GPU_PAL_BG, 0)
+
+struct gpu_buffer
+{
+	uint8_t pixels[GB_SCREEN_HEIGHT][GB_SCREEN_WIDTH];
+	uint8_t palettes[GB_SCREEN_HEIGHT][GPU_PALETTES];
+};
+
+static GBOYEMU_STATE struct
+{
+	/* where current frame is rendered: own buffer when headless,
+	 * back buffer of the presenter otherwise
+	 */
+	struct gpu_buffer *back;
+	struct gpu_buffer buffer;
+	/* no SDL at all
+	 */
+	uint32_t headless;
+	/* current frame is not rendered nor displayed
+	 * (latched when frame starts)
+	 */
+	uint32_t skip;
+} gpu_frame;
+
+/* SDL video is not thread safe: frames are displayed by the main
+ * thread, while emulation runs in its own thread, so that SDL blit/flip
+ * (and any vsync wait) never delay it. lock-free triple buffer:
+ * emulation renders into back, swaps it with ready when a frame is
+ * complete; presenter swaps front with ready when it is fresh.
+ * only one SDL instance exists, so this is not thread local.
+ */
+#define GPU_BUFFERS 3
+#define GPU_BUFFER_FRESH 0x4
+
+static struct
+{
+	struct gpu_buffer buffers[GPU_BUFFERS];
+	uint32_t back;		/* emulation thread only */
+	uint32_t front;		/* presenter (main thread) only */
+	struct gpu_buffer shown;	/* last displayed frame (presenter only) */
+	uint32_t displayed;	/* shown is valid (presenter only) */
+	uint32_t current;	/* zoom of gb_surface (presenter only) */
+	atomic_uint ready;	/* buffer index | GPU_BUFFER_FRESH */
+	atomic_uint zoom;	/* zoom of ready frame */
+	sem_t wake;
+	uint32_t opened;
+} gpu_presenter;
+
 struct sprite
 {
 	uint8_t y;
@@ -39,7 +110,7 @@ struct sprite
 	uint8_t flags;
 };
 
-static struct
+static GBOYEMU_STATE struct
 {
 	int32_t cycles;
 	uint8_t ly, lycmp;
@@ -68,20 +139,35 @@ static struct
 	uint8_t vram[0x2000];
 #define MAX_SPRITES 40
 	uint8_t oam[MAX_SPRITES * sizeof(struct sprite)];
+	/* OAM DMA in progress: OAM is not accessible by the CPU
+	 */
+#define GPU_CYCLES_DMA 640
+	int32_t dma_cycles;
 } gpu;
 
-static struct
+static GBOYEMU_STATE struct
 {
-	uint32_t bgp_sdl[4];
-	uint32_t objpal_sdl[2][4];
-
 #define MAX_TILES 384
-	/* pre-computed tiles with zoom applied (only on x-axis)
+	/* pre-computed tiles: one color number per byte
+	 */
+	uint8_t tiles[MAX_TILES][64];
+	/* tiles whose VRAM data changed since they were computed,
+	 * one bit per tile
 	 */
-	uint8_t tiles[MAX_TILES][64*GPU_ZOOM_MAX];
+	uint64_t dirty[MAX_TILES / 64];
+
+#define MAX_SPRITES_PER_LINE 10
+	/* OAM indexes of sprites displayed on each line, from highest
+	 * to lowest priority. built when first needed after OAM
+	 * or sprite size changed.
+	 */
+	uint8_t line_sprites[GB_SCREEN_HEIGHT][MAX_SPRITES_PER_LINE];
+	uint8_t line_sprites_count[GB_SCREEN_HEIGHT];
+	uint8_t line_sprites_height;
+	uint32_t line_sprites_valid;
 } gpu_cache;
 
-static struct
+static GBOYEMU_STATE struct
 {
 	uint32_t current;
 	uint32_t requested;
@@ -106,6 +192,28 @@ static const uint8_t gpu_grey_colors[] =
 };
 
 static void gpu_set_ly(uint8_t ly);
+static void gpu_blank_gb_surface(void);
+
+/* tile rows are planar: bit 7-x of first byte is bit 0 of pixel x color,
+ * same bit of second byte is bit 1. each entry spreads the 8 bits of a byte
+ * to the low bit of 8 bytes (leftmost pixel first in memory), so a row
+ * decodes as spread[byte0] | spread[byte1] << 1 (no carry between bytes).
+ */
+static uint64_t gpu_tile_spread[256];
+static pthread_once_t gpu_tile_once = PTHREAD_ONCE_INIT;
+
+static void gpu_build_tile_spread(void)
+{
+	uint8_t bytes[8];
+	uint32_t value, x;
+
+	for ( value = 0; value < 256; value++ )
+	{
+		for ( x = 0; x < 8; x++ )
+			bytes[x] = (value >> (7 - x)) & 0x1;
+		memcpy(&gpu_tile_spread[value], bytes, sizeof(bytes));
+	}
+}
 
 static uint32_t gpu_adjust_zoom(uint32_t zoom)
 {
@@ -114,7 +222,7 @@ static uint32_t gpu_adjust_zoom(uint32_t zoom)
 	return zoom;
 }
 
-static int32_t gpu_create_gb_surface(void)
+static int32_t gpu_create_gb_surface(uint32_t zoom)
 {
 	uint32_t rmask, gmask, bmask, amask;
 #if SDL_BYTEORDER == SDL_BIG_ENDIAN
@@ -131,8 +239,10 @@ static int32_t gpu_create_gb_surface(void)
 
 	if ( gb_surface != NULL )
 		SDL_FreeSurface(gb_surface);
+	gpu_presenter.current = zoom;
+	gpu_presenter.displayed = 0;
 
-	gb_surface = SDL_CreateRGBSurface(SDL_SWSURFACE, GB_SCREEN_WIDTH * gpu_zoom.current, GB_SCREEN_HEIGHT * gpu_zoom.current,
+	gb_surface = SDL_CreateRGBSurface(SDL_SWSURFACE, GB_SCREEN_WIDTH * zoom, GB_SCREEN_HEIGHT * zoom,
 		SDL_BYTES_PER_PIXEL * 8, rmask, gmask, bmask, amask);
 
 	if ( gb_surface == NULL )
@@ -146,13 +256,15 @@ static int32_t gpu_create_gb_surface(void)
 	if ( gb_surface->format->BytesPerPixel != SDL_BYTES_PER_PIXEL )
 	{
 		fprintf(stderr, "Unattended bytes per pixel value: %u\n", gb_surface->format->BytesPerPixel);
+		SDL_FreeSurface(gb_surface);
+		gb_surface = NULL;
 		return -1;
 	}
 
-	screen_rect.x = (GPU_ZOOM_MAX - gpu_zoom.current) * GB_SCREEN_WIDTH / 2;
-	screen_rect.y = (GPU_ZOOM_MAX - gpu_zoom.current) * GB_SCREEN_HEIGHT / 2;
-	screen_rect.w = GB_SCREEN_WIDTH * gpu_zoom.current;
-	screen_rect.h = GB_SCREEN_HEIGHT * gpu_zoom.current;
+	screen_rect.x = (GPU_ZOOM_MAX - zoom) * GB_SCREEN_WIDTH / 2;
+	screen_rect.y = (GPU_ZOOM_MAX - zoom) * GB_SCREEN_HEIGHT / 2;
+	screen_rect.w = GB_SCREEN_WIDTH * zoom;
+	screen_rect.h = GB_SCREEN_HEIGHT * zoom;
 
 	SDL_FillRect(screen, NULL, SDL_COLOR_BUILD(0xE0, 0xE0, 0xE0, SDL_ALPHA_OPAQUE));
 	SDL_Flip(screen);
@@ -160,16 +272,50 @@ static int32_t gpu_create_gb_surface(void)
 	return 0;
 }
 
-int32_t gpu_init(uint32_t zoom)
+int32_t gpu_init(uint32_t zoom, uint32_t headless)
 {
+	pthread_once(&gpu_tile_once, gpu_build_tile_spread);
+
 	memset(&gpu, 0, sizeof(gpu));
 	memset(&gpu_cache, 0, sizeof(gpu_cache));
+	memset(&gpu_frame, 0, sizeof(gpu_frame));
 	gpu.lcdctrl = LCDCTRL_LCD_ON | LCDCTRL_BG_AND_WINDOW_TILE_SET | LCDCTRL_BG_ON;
 	gpu.lcdstatus = 0x02;
 	gpu_set_ly(0);
+
+	if ( headless )
+	{
+		/* frame stays in memory, no SDL video
+		 */
+		gpu_zoom.current = 1;
+		gpu_zoom.requested = 1;
+		gpu_frame.headless = 1;
+		gpu_frame.back = &gpu_frame.buffer;
+		gpu_blank_gb_surface();
+		return 0;
+	}
+
 	gpu_zoom.current = gpu_adjust_zoom(zoom);
 	gpu_zoom.requested = gpu_zoom.current;
 
+	/* frames go to the screen opened by main thread
+	 */
+	if ( gpu_presenter.opened == 0 )
+	{
+		fprintf(stderr, "Screen is not opened\n");
+		return -1;
+	}
+	gpu_frame.back = &gpu_presenter.buffers[gpu_presenter.back];
+
+	return 0;
+}
+
+/* main thread only, before emulation starts
+ */
+int32_t gpu_open_screen(void)
+{
+	uint32_t i;
+
 	screen = SDL_SetVideoMode(GB_SCREEN_WIDTH * GPU_ZOOM_MAX, GB_SCREEN_HEIGHT * GPU_ZOOM_MAX,
 			SDL_BYTES_PER_PIXEL * 8, SDL_HWSURFACE | SDL_DOUBLEBUF);
 
@@ -185,64 +331,85 @@ int32_t gpu_init(uint32_t zoom)
 		return -1;
 	}
 
-	if ( gpu_create_gb_surface() < 0 )
+	/* buffer 0 is rendered first, 1 is ready (not fresh),
+	 * 2 is owned by presenter. gb_surface is created at the
+	 * zoom of first frame.
+	 */
+	gpu_presenter.back = 0;
+	gpu_presenter.front = 2;
+	gpu_presenter.current = 0;
+	gpu_presenter.displayed = 0;
+	atomic_store(&gpu_presenter.ready, 1);
+	for ( i = 0; i < GPU_BUFFERS; i++ )
+		memset(gpu_presenter.buffers[i].pixels, GPU_PIXEL_BLANK, sizeof(gpu_presenter.buffers[i].pixels));
+
+	if ( sem_init(&gpu_presenter.wake, 0, 0) < 0 )
+	{
+		fprintf(stderr, "Could not create presenter semaphore\n");
 		return -1;
+	}
+	gpu_presenter.opened = 1;
 
 	return 0;
 }
 
+void gpu_close_screen(void)
+{
+	if ( gpu_presenter.opened == 0 )
+		return;
+
+	if ( gb_surface != NULL )
+		SDL_FreeSurface(gb_surface);
+	gb_surface = NULL;
+	sem_destroy(&gpu_presenter.wake);
+	gpu_presenter.opened = 0;
+}
+
 static void gpu_blank_curline(void)
 {
-	SDL_Rect rect;
 	assert(gpu.ly < GB_SCREEN_HEIGHT);
-	rect.x = 0;
-	rect.y = gpu.ly * gpu_zoom.current;
-	rect.w = GB_SCREEN_WIDTH * gpu_zoom.current;
-	rect.h = gpu_zoom.current;
-	if ( SDL_FillRect(gb_surface, &rect, SDL_COLOR_BUILD(0xFF, 0xFF, 0xFF, SDL_ALPHA_OPAQUE)) < 0 )
-		fprintf(stderr, "Can't blank current line: %s\n", SDL_GetError());
+	memset(gpu_frame.back->pixels[gpu.ly], GPU_PIXEL_BLANK, GB_SCREEN_WIDTH);
 }
 
 static void gpu_blank_gb_surface(void)
 {
-	/* fill the entire surface
+	/* fill the entire frame
 	 */
-	if ( SDL_FillRect(gb_surface, NULL, SDL_COLOR_BUILD(0xFF, 0xFF, 0xFF, SDL_ALPHA_OPAQUE)) < 0 )
-		fprintf(stderr, "Can't blank gb_surface: %s\n", SDL_GetError());
+	memset(gpu_frame.back->pixels, GPU_PIXEL_BLANK, sizeof(gpu_frame.back->pixels));
 }
 
-static inline uint32_t gpu_blending(uint32_t dst, uint32_t src, uint8_t blending)
+static inline uint8_t gpu_blending(uint8_t dst, uint8_t color, uint8_t pal, uint8_t blending)
 {
 	if ( (blending & BLENDING_SRC_OPAQUE) == BLENDING_SRC_OPAQUE )
-		if ( SDL_COLOR_GET_ALPHA(src) != SDL_ALPHA_OPAQUE )
+		if ( color == 0 )
 			return dst;
 
 	if ( (blending & BLENDING_DST_TRANSPARENT) == BLENDING_DST_TRANSPARENT )
-		if ( SDL_COLOR_GET_ALPHA(dst) != SDL_ALPHA_TRANSPARENT )
+		if ( dst != GPU_PIXEL_TRANSPARENT )
 			return dst;
 
-	return src;
+	return GPU_PIXEL(pal, color);
 }
 
-/* blit src to dst
+/* blit src color numbers to dst pixels
  */
 static void *gpu_blit(void *dst, const void *src, size_t n, uint32_t reverse_src, uint8_t blending,
-	const uint32_t pal[static 4])
+	uint8_t pal)
 {
-	uint32_t *d;
-	const char *s;
+	uint8_t *d;
+	const uint8_t *s;
 
 
 	d = dst;
 	if ( reverse_src )
-		s = src - 1;
+		s = (const uint8_t *)src - 1;
 	else
 		s = src;
 
 	while ( n > 0 )
 	{
 		assert(*s <= 3);
-		*d = gpu_blending(*d, pal[(uint8_t)*s], blending);
+		*d = gpu_blending(*d, *s, pal, blending);
 		d++;
 		if ( reverse_src )
 			s--;
@@ -306,16 +473,6 @@ void gpu_write_lycmp(uint8_t lycmp)
 	gpu_set_lycmp(lycmp);
 }
 
-static uint32_t gpu_compute_sdl_color(uint8_t src, uint8_t bit_index)
-{
-	uint32_t sdl_color;
-	uint8_t rgb, alpha;
-	rgb = gpu_grey_colors[(src >> (bit_index * 2)) & 0x3];
-	alpha = (bit_index == 0) ? SDL_ALPHA_TRANSPARENT : SDL_ALPHA_OPAQUE;
-	sdl_color = SDL_COLOR_BUILD(rgb, rgb, rgb, alpha);
-	return sdl_color;
-}
-
 void gpu_write_bgp(uint8_t bgp)
 {
 	/* FF47 - BGP - BG Palette Data (R/W) - Non CGB Mode Only
@@ -332,10 +489,7 @@ void gpu_write_bgp(uint8_t bgp)
 	 * 3  Black
 	 */
 
-	int32_t i;
 	gpu.bgp = bgp;
-	for ( i = 0; i < 4; i++)
-		gpu_cache.bgp_sdl[i] = gpu_compute_sdl_color(gpu.bgp, i);
 }
 
 uint8_t gpu_read_bgp(void)
@@ -415,19 +569,12 @@ uint8_t gpu_read_windowy(void)
 
 void gpu_write_objpal0(uint8_t objpal0)
 {
-	int32_t i;
 	gpu.objpal[0] = objpal0;
-	for ( i = 0; i < 4; i++)
-		gpu_cache.objpal_sdl[0][i] = gpu_compute_sdl_color(gpu.objpal[0], i);
 }
 
 void gpu_write_objpal1(uint8_t objpal1)
 {
-	int32_t i;
 	gpu.objpal[1] = objpal1;
-	for ( i = 0; i < 4; i++)
-		gpu_cache.objpal_sdl[1][i] = gpu_compute_sdl_color(gpu.objpal[1], i);
-
 }
 
 uint8_t gpu_read_objpal0(void)
@@ -440,10 +587,11 @@ uint8_t gpu_read_objpal1(void)
 	return gpu.objpal[1];
 }
 
-static inline void gpu_compute_tile(uint32_t tile)
+static void gpu_compute_tile(uint32_t tile)
 {
 	uint16_t address;
-	uint8_t *ptr, byte0, byte1;
+	uint8_t *ptr;
+	uint64_t row;
 	uint32_t byte;
 
 	/* VRAM Tile Data
@@ -461,36 +609,45 @@ static inline void gpu_compute_tile(uint32_t tile)
 
 	for ( byte = 0; byte < 8; byte++ )
 	{
-		byte0 = gpu.vram[address++];
-		byte1 = gpu.vram[address++];
-
-		memset(&ptr[0*gpu_zoom.current], ((byte0 & 0x80) >> 7) | ((byte1 & 0x80) >> 6), gpu_zoom.current);
-
-		memset(&ptr[1*gpu_zoom.current], ((byte0 & 0x40) >> 6) | ((byte1 & 0x40) >> 5), gpu_zoom.current);
-
-		memset(&ptr[2*gpu_zoom.current], ((byte0 & 0x20) >> 5) | ((byte1 & 0x20) >> 4), gpu_zoom.current);
+		row = gpu_tile_spread[gpu.vram[address]] | (gpu_tile_spread[gpu.vram[address + 1]] << 1);
+		memcpy(ptr, &row, sizeof(row));
 
-		memset(&ptr[3*gpu_zoom.current], ((byte0 & 0x10) >> 4) | ((byte1 & 0x10) >> 3), gpu_zoom.current);
-
-		memset(&ptr[4*gpu_zoom.current], ((byte0 & 0x08) >> 3) | ((byte1 & 0x08) >> 2), gpu_zoom.current);
-
-		memset(&ptr[5*gpu_zoom.current], ((byte0 & 0x04) >> 2) | ((byte1 & 0x04) >> 1), gpu_zoom.current);
+		address += 2;
+		ptr += 8;
+	}
+}
 
-		memset(&ptr[6*gpu_zoom.current], ((byte0 & 0x02) >> 1) | ((byte1 & 0x02) >> 0), gpu_zoom.current);
+static inline void gpu_invalidate_tile(uint32_t tile)
+{
+	assert(tile < MAX_TILES);
+	gpu_cache.dirty[tile / 64] |= (uint64_t)1 << (tile % 64);
+}
 
-		memset(&ptr[7*gpu_zoom.current], ((byte0 & 0x01) >> 0) | ((byte1 & 0x01) << 1), gpu_zoom.current);
+/* compute tiles modified since last rendered line
+ */
+static inline void gpu_update_tiles(void)
+{
+	uint64_t dirty;
+	uint32_t i;
 
-		ptr += 8 * gpu_zoom.current;
+	for ( i = 0; i < MAX_TILES / 64; i++ )
+	{
+		dirty = gpu_cache.dirty[i];
+		while ( dirty != 0 )
+		{
+			gpu_compute_tile(i * 64 + __builtin_ctzll(dirty));
+			dirty &= dirty - 1;
+		}
+		gpu_cache.dirty[i] = 0;
 	}
 }
 
 static void gpu_display_tile_line(uint32_t x, uint32_t y, uint32_t tile_number,
 	uint8_t tile_x_offset, uint8_t tile_y_offset,
 	uint8_t xflip, uint8_t yflip, uint8_t blending,
-	const uint32_t pal[static 4])
+	uint8_t pal)
 {
-	uint32_t a, i;
-	uint8_t *pixels = (uint8_t *)gb_surface->pixels;
+	uint32_t a;
 
 	assert(tile_number < MAX_TILES);
 	assert(tile_x_offset < 8);
@@ -509,12 +666,9 @@ static void gpu_display_tile_line(uint32_t x, uint32_t y, uint32_t tile_number,
 	if ( xflip )
 		tile_x_offset = 8 - tile_x_offset;
 
-	for ( i = 0; i < gpu_zoom.current; i++ )
-	{
-		gpu_blit(&pixels[(y * gpu_zoom.current * gb_surface->pitch) + (i * gb_surface->pitch) + (x * gpu_zoom.current * SDL_BYTES_PER_PIXEL)],
-			&gpu_cache.tiles[tile_number][(tile_y_offset * 8 + tile_x_offset) * gpu_zoom.current],
-			a * gpu_zoom.current, xflip, blending, pal);
-	}
+	gpu_blit(&gpu_frame.back->pixels[y][x],
+		&gpu_cache.tiles[tile_number][tile_y_offset * 8 + tile_x_offset],
+		a, xflip, blending, pal);
 }
 
 static uint32_t gpu_y_totile(uint8_t y, uint8_t *offsety)
@@ -585,7 +739,7 @@ static void gpu_display_background(void)
 			0,		/* x-flip disabled */
 			0,		/* y-flip disabled */
 			0,		/* blending */
-			gpu_cache.bgp_sdl	/* background palette */
+			GPU_PAL_BG	/* background palette */
 			);
 	}
 }
@@ -646,40 +800,68 @@ static void gpu_display_window(void)
 			0,		/* x-flip disabled */
 			0,		/* y-flip disabled */
 			0,		/* blending */
-			gpu_cache.bgp_sdl	/* background palette */
+			GPU_PAL_BG	/* background palette */
 			);
 		htile++;
 	}
 }
 
-/* compare two sprites according to their priority
- * return +1 if priority(sprite1) < priority(sprite2)
- * return -1 if priority(sprite1) > priority(sprite2)
+/* sprite with smaller x has priority, then the one with smaller
+ * OAM index. select the 10 sprites with highest priority
+ * on each line.
  */
-static int32_t gpu_sprite_priority(const void *s1, const void *s2)
+static void gpu_build_line_sprites(uint32_t height)
 {
-	struct sprite * const *sprite1 = s1;
-	struct sprite * const *sprite2 = s2;
+	uint8_t order[MAX_SPRITES];
+	const struct sprite *sprite;
+	uint32_t i, j;
+	int32_t y, line;
 
-	if ( (*sprite1)->x < (*sprite2)->x )
-		return 1;
-	else if ( (*sprite1)->x > (*sprite2)->x )
-		return -1;
-	else if ( *sprite1 < *sprite2 )
-		return 1;
-	else
-		return -1;
+	/* OAM indexes by decreasing priority (stable insertion sort on x)
+	 */
+	for ( i = 0; i < MAX_SPRITES; i++ )
+	{
+		sprite = (const struct sprite *)&gpu.oam[i * sizeof(struct sprite)];
+		for ( j = i; j > 0; j-- )
+		{
+			if ( ((const struct sprite *)&gpu.oam[order[j - 1] * sizeof(struct sprite)])->x <= sprite->x )
+				break;
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+
+	memset(gpu_cache.line_sprites_count, 0, sizeof(gpu_cache.line_sprites_count));
+	for ( i = 0; i < MAX_SPRITES; i++ )
+	{
+		sprite = (const struct sprite *)&gpu.oam[order[i] * sizeof(struct sprite)];
+
+		/* current sprite is not visible ?
+		 */
+		if ( sprite->y == 0 || sprite->y >= GB_SCREEN_HEIGHT + 16 )
+			continue;
+
+		y = sprite->y - 16;
+		for ( line = max(y, 0); line < y + (int32_t)height && line < GB_SCREEN_HEIGHT; line++ )
+		{
+			if ( gpu_cache.line_sprites_count[line] < MAX_SPRITES_PER_LINE )
+				gpu_cache.line_sprites[line][gpu_cache.line_sprites_count[line]++] = order[i];
+		}
+	}
+
+	gpu_cache.line_sprites_height = height;
+	gpu_cache.line_sprites_valid = 1;
 }
 
 static void gpu_display_sprites(void)
 {
 	int32_t i, x, y;
-	int32_t sprites_count, sprite_start, sprite_end, tile_number;
+	int32_t tile_number;
 	struct sprite *sprite;
 	uint8_t blending;
 	uint8_t palette, offsety;
 	uint8_t yflip;
-	struct sprite *sprites[MAX_SPRITES];
+	uint32_t height;
 
 #define TILE0(tile) ((tile) & 0xFE)
 #define TILE1(tile) ((tile) | 0x01)
@@ -687,51 +869,20 @@ static void gpu_display_sprites(void)
 	if ( (gpu.lcdctrl & LCDCTRL_SPRITE_ON) == 0 )
 		return;
 
-	/* select all sprites that fit on current display line gpu.ly
-	 */
-	sprites_count = 0;
-	for ( i = 0; i < MAX_SPRITES; i++ )
-	{
-		sprite = (struct sprite *)&gpu.oam[i * sizeof(struct sprite)];
-
-		x = sprite->x - 8;
-		y = sprite->y - 16;
-
-		/* current sprite is not on line gpu.ly ?
-		 */
-		if ( (gpu.lcdctrl & LCDCTRL_SPRITE_8x16) == LCDCTRL_SPRITE_8x16 )
-		{
-			if ( gpu.ly < y || gpu.ly > y + 15 )
-				continue;
-		}
-		else
-		{
-			if ( gpu.ly < y || gpu.ly > y + 7 )
-				continue;
-		}
-
-		/* current sprite is not visible ?
-		 */
-		if ( sprite->y == 0 || sprite->y >= GB_SCREEN_HEIGHT + 16 )
-			continue;
-
-		sprites[sprites_count] = sprite;
-		sprites_count++;
-	}
+	if ( (gpu.lcdctrl & LCDCTRL_SPRITE_8x16) == LCDCTRL_SPRITE_8x16 )
+		height = 16;
+	else
+		height = 8;
 
-	/* sort sprites by lower to higher priority
-	 */
-	qsort(sprites, sprites_count, sizeof(struct sprite *), gpu_sprite_priority);
+	if ( gpu_cache.line_sprites_valid == 0 || gpu_cache.line_sprites_height != height )
+		gpu_build_line_sprites(height);
 
-	/* now display max 10 sprites with highest priorities
-	 * on current line
+	/* display sprites of current line gpu.ly from lower to
+	 * higher priority
 	 */
-	sprite_start = max(sprites_count - 10, 0);
-	sprite_end = sprites_count;
-
-	for ( i = sprite_start; i < sprite_end; i++ )
+	for ( i = gpu_cache.line_sprites_count[gpu.ly] - 1; i >= 0; i-- )
 	{
-		sprite = sprites[i];
+		sprite = (struct sprite *)&gpu.oam[gpu_cache.line_sprites[gpu.ly][i] * sizeof(struct sprite)];
 
 		/* current sprite is not visible ?
 		 */
@@ -747,9 +898,9 @@ static void gpu_display_sprites(void)
 			blending = BLENDING_SRC_OPAQUE;
 
 		if ( (sprite->flags & SPRITE_PALETTE) == SPRITE_PALETTE )
-			palette = 1;
+			palette = GPU_PAL_OBJ1;
 		else
-			palette = 0;
+			palette = GPU_PAL_OBJ0;
 
 		yflip = sprite->flags & SPRITE_YFLIP;
 
@@ -787,7 +938,7 @@ static void gpu_display_sprites(void)
 			sprite->flags & SPRITE_XFLIP,
 			yflip,
 			blending,
-			gpu_cache.objpal_sdl[palette]
+			palette
 			);
 	}
 }
@@ -800,11 +951,241 @@ void gpu_display(void)
 		return;
 	}
 
-	SDL_LockSurface(gb_surface);
+	/* tiles are only computed when a line needs them
+	 * (a tile upload writes each tile 16 times)
+	 */
+	gpu_update_tiles();
+
+	/* palettes used by this line
+	 */
+	gpu_frame.back->palettes[gpu.ly][GPU_PAL_BG] = gpu.bgp;
+	gpu_frame.back->palettes[gpu.ly][GPU_PAL_OBJ0] = gpu.objpal[0];
+	gpu_frame.back->palettes[gpu.ly][GPU_PAL_OBJ1] = gpu.objpal[1];
+
 	gpu_display_background();
 	gpu_display_window();
 	gpu_display_sprites();
+}
+
+/* shade (0 = white ... 3 = black) of each pixel value
+ * with palettes of line y
+ */
+static void gpu_line_shades(const struct gpu_buffer *buffer, uint32_t y,
+	uint8_t shades[GPU_PALETTES * 4])
+{
+	uint32_t pal, color;
+
+	for ( pal = 0; pal < GPU_PALETTES; pal++ )
+	{
+		for ( color = 0; color < 4; color++ )
+		{
+			if ( pal == GPU_PAL_BLANK )
+				shades[GPU_PIXEL(pal, color)] = 0;
+			else
+				shades[GPU_PIXEL(pal, color)] = (buffer->palettes[y][pal] >> (color * 2)) & 0x3;
+		}
+	}
+}
+
+/* lookup of 16-entry byte table for a line of pixel values
+ */
+static void gpu_lookup_line(uint8_t *dst, const uint8_t *src, const uint8_t lut[16])
+{
+	uint32_t x;
+
+	for ( x = 0; x < GB_SCREEN_WIDTH; x++ )
+		dst[x] = lut[src[x]];
+}
+
+/* grey levels of a line of pixel values to colors,
+ * each one written zoom times
+ */
+static void gpu_convert_line(uint32_t *dst, const uint8_t *src, const uint8_t grey[16],
+	uint32_t zoom)
+{
+	uint32_t colors[16];
+	uint32_t x, z, i, color;
+
+	for ( i = 0; i < 16; i++ )
+		colors[i] = SDL_COLOR_BUILD(grey[i], grey[i], grey[i], SDL_ALPHA_OPAQUE);
+
+	for ( x = 0; x < GB_SCREEN_WIDTH; x++ )
+	{
+		color = colors[src[x]];
+		for ( z = 0; z < zoom; z++ )
+			*dst++ = color;
+	}
+}
+
+#ifdef GPU_SSSE3
+/* pixel values are 4 bits: a single pshufb looks up 16 of them.
+ * SDL build does not enable SSSE3, so these are selected at runtime.
+ */
+__attribute__((target("ssse3")))
+static void gpu_lookup_line_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t lut[16])
+{
+	__m128i table;
+	uint32_t x;
+
+	table = _mm_loadu_si128((const __m128i *)lut);
+	for ( x = 0; x < GB_SCREEN_WIDTH; x += 16 )
+	{
+		_mm_storeu_si128((__m128i *)&dst[x],
+			_mm_shuffle_epi8(table, _mm_loadu_si128((const __m128i *)&src[x])));
+	}
+}
+
+/* spread[m] turns 16 grey levels into colors m*4 to m*4+3 of
+ * the 16*zoom ones they produce: grey copied to r, g and b,
+ * alpha cleared (then set by a or)
+ */
+static void gpu_build_spread(uint8_t spread[4 * GPU_ZOOM_MAX][16], uint32_t zoom)
+{
+	uint32_t m, c;
+
+	for ( m = 0; m < 4 * zoom; m++ )
+	{
+		for ( c = 0; c < 4; c++ )
+		{
+			memset(&spread[m][c * 4], (m * 4 + c) / zoom, 3);
+			spread[m][c * 4 + 3] = 0x80;
+		}
+	}
+}
+
+__attribute__((target("ssse3")))
+static void gpu_convert_line_ssse3(uint32_t *dst, const uint8_t *src, const uint8_t grey[16],
+	uint32_t zoom, uint8_t spread[4 * GPU_ZOOM_MAX][16])
+{
+	__m128i table, alpha, levels;
+	uint32_t x, m;
+
+	table = _mm_loadu_si128((const __m128i *)grey);
+	alpha = _mm_set1_epi32(SDL_COLOR_BUILD(0, 0, 0, SDL_ALPHA_OPAQUE));
+	for ( x = 0; x < GB_SCREEN_WIDTH; x += 16 )
+	{
+		levels = _mm_shuffle_epi8(table, _mm_loadu_si128((const __m128i *)&src[x]));
+		for ( m = 0; m < 4 * zoom; m++ )
+		{
+			_mm_storeu_si128((__m128i *)dst, _mm_or_si128(alpha,
+				_mm_shuffle_epi8(levels, _mm_loadu_si128((const __m128i *)spread[m]))));
+			dst += 4;
+		}
+	}
+}
+#endif
+
+/* convert frame to colors into gb_surface, scaled by zoom
+ * (nearest neighbor), then display it
+ */
+static void gpu_present(const struct gpu_buffer *buffer, uint32_t zoom)
+{
+	uint8_t grey[GPU_PALETTES * 4];
+#ifdef GPU_SSSE3
+	uint8_t spread[4 * GPU_ZOOM_MAX][16];
+	uint32_t ssse3;
+#endif
+	uint32_t *line;
+	uint8_t *pixels;
+	uint32_t y, i, z;
+
+#ifdef GPU_SSSE3
+	ssse3 = __builtin_cpu_supports("ssse3");
+	if ( ssse3 )
+		gpu_build_spread(spread, zoom);
+#endif
+
+	SDL_LockSurface(gb_surface);
+	pixels = gb_surface->pixels;
+
+	for ( y = 0; y < GB_SCREEN_HEIGHT; y++ )
+	{
+		gpu_line_shades(buffer, y, grey);
+		for ( i = 0; i < sizeof(grey); i++ )
+			grey[i] = gpu_grey_colors[grey[i]];
+
+		line = (uint32_t *)&pixels[y * zoom * gb_surface->pitch];
+#ifdef GPU_SSSE3
+		if ( ssse3 )
+			gpu_convert_line_ssse3(line, buffer->pixels[y], grey, zoom, spread);
+		else
+#endif
+			gpu_convert_line(line, buffer->pixels[y], grey, zoom);
+
+		/* repeat line zoom times
+		 */
+		for ( z = 1; z < zoom; z++ )
+		{
+			memcpy(&pixels[(y * zoom + z) * gb_surface->pitch],
+				&pixels[y * zoom * gb_surface->pitch],
+				GB_SCREEN_WIDTH * zoom * SDL_BYTES_PER_PIXEL);
+		}
+	}
+
 	SDL_UnlockSurface(gb_surface);
+
+	SDL_BlitSurface(gb_surface, NULL, screen, &screen_rect);
+	SDL_Flip(screen);
+}
+
+/* wait up to timeout ms for a completed frame, then display it
+ * (main thread only)
+ */
+void gpu_show(uint32_t timeout)
+{
+	const struct gpu_buffer *buffer;
+	struct timespec deadline;
+	uint32_t zoom;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += (long)timeout * 1000000;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+	sem_timedwait(&gpu_presenter.wake, &deadline);
+
+	/* take latest completed frame
+	 */
+	if ( (atomic_load(&gpu_presenter.ready) & GPU_BUFFER_FRESH) == 0 )
+		return;
+	gpu_presenter.front = atomic_exchange(&gpu_presenter.ready,
+		gpu_presenter.front) & ~GPU_BUFFER_FRESH;
+
+	buffer = &gpu_presenter.buffers[gpu_presenter.front];
+
+	zoom = atomic_load(&gpu_presenter.zoom);
+	if ( zoom != gpu_presenter.current && gpu_create_gb_surface(zoom) < 0 )
+		return;
+	if ( gb_surface == NULL )
+		return;
+
+	/* static screens (menus, pauses...): same pixels
+	 * and palettes as displayed frame, nothing to do
+	 */
+	if ( gpu_presenter.displayed && memcmp(buffer, &gpu_presenter.shown, sizeof(*buffer)) == 0 )
+		return;
+	memcpy(&gpu_presenter.shown, buffer, sizeof(*buffer));
+	gpu_presenter.displayed = 1;
+
+	gpu_present(buffer, zoom);
+}
+
+/* hand completed frame over to presenter, never waits
+ */
+static void gpu_publish(void)
+{
+	uint32_t previous;
+
+	atomic_store(&gpu_presenter.zoom, gpu_zoom.current);
+	previous = atomic_exchange(&gpu_presenter.ready,
+		gpu_presenter.back | GPU_BUFFER_FRESH);
+	gpu_presenter.back = previous & ~GPU_BUFFER_FRESH;
+	gpu_frame.back = &gpu_presenter.buffers[gpu_presenter.back];
+
+	/* presenter has not taken previous frame yet:
+	 * it is already woken up and will take this one
+	 */
+	if ( (previous & GPU_BUFFER_FRESH) == 0 )
+		sem_post(&gpu_presenter.wake);
 }
 
 void gpu_set_zoom(uint32_t zoom)
@@ -817,10 +1198,50 @@ uint32_t gpu_get_zoom(void)
 	return gpu_zoom.current;
 }
 
-void gpu_run(uint32_t cycles, uint32_t frame_skip)
+/* copy screen being rendered (last completed one at VBLANK) at 1x into dst (GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT bytes),
+ * either as 2-bit shade indices or as grey levels
+ */
+void gpu_copy_screen(uint8_t *dst, enum gpu_screen_format format)
+{
+	uint8_t lut[GPU_PALETTES * 4];
+	uint32_t y, i;
+#ifdef GPU_SSSE3
+	uint32_t ssse3;
+
+	ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+	for ( y = 0; y < GB_SCREEN_HEIGHT; y++ )
+	{
+		gpu_line_shades(gpu_frame.back, y, lut);
+		if ( format == GPU_SCREEN_GREY )
+		{
+			for ( i = 0; i < sizeof(lut); i++ )
+				lut[i] = gpu_grey_colors[lut[i]];
+		}
+
+#ifdef GPU_SSSE3
+		if ( ssse3 )
+			gpu_lookup_line_ssse3(dst, gpu_frame.back->pixels[y], lut);
+		else
+#endif
+			gpu_lookup_line(dst, gpu_frame.back->pixels[y], lut);
+		dst += GB_SCREEN_WIDTH;
+	}
+}
+
+/* return 1 when a frame has just been completed (VBLANK start).
+ * frame_skip is sampled when next frame starts (VBLANK end):
+ * if set, that frame is neither rendered nor displayed.
+ */
+uint32_t gpu_run(uint32_t cycles, uint32_t frame_skip)
 {
 	uint32_t mode;
-	uint32_t i;
+	uint32_t skip;
+	uint32_t vblank = 0;
+
+	if ( gpu.dma_cycles > 0 )
+		gpu.dma_cycles -= cycles;
 
 	mode = gpu.lcdstatus & LCDSTATUS_MODE_FLAG;
 	gpu.cycles += cycles;
@@ -871,6 +1292,7 @@ void gpu_run(uint32_t cycles, uint32_t frame_skip)
 				gpu_set_ly(gpu.ly + 1);
 				if ( gpu.ly == GPU_LY_VBLANK_START )
 				{
+					vblank = 1;
 					interrupt_request(INTERRUPT_VBLANK);
 					if ( (gpu.lcdstatus & LCDSTATUS_MODE1_VBLANK_INTERRUPT) == LCDSTATUS_MODE1_VBLANK_INTERRUPT )
 						interrupt_request(INTERRUPT_LCDSTAT);
@@ -895,16 +1317,18 @@ void gpu_run(uint32_t cycles, uint32_t frame_skip)
 					gpu_set_ly(0);
 					if ( (gpu.lcdstatus & LCDSTATUS_MODE2_OAM_INTERRUPT) == LCDSTATUS_MODE2_OAM_INTERRUPT )
 						interrupt_request(INTERRUPT_LCDSTAT);
-					SDL_BlitSurface(gb_surface, NULL, screen, &screen_rect);
-					SDL_Flip(screen);
-					if ( gpu_zoom.requested != gpu_zoom.current )
-					{
-						gpu_zoom.current = gpu_zoom.requested;
-						gpu_create_gb_surface();
-						for ( i = 0; i < MAX_TILES; i++ )
-							gpu_compute_tile(i);
-					}
 					mode = 2;
+
+					/* display frame just completed, then decide
+					 * whether next one is rendered
+					 */
+					skip = gpu_frame.skip;
+					gpu_frame.skip = frame_skip;
+					if ( gpu_frame.headless )
+						break;
+					gpu_zoom.current = gpu_zoom.requested;
+					if ( skip == 0 )
+						gpu_publish();
 				}
 				break;
 
@@ -920,7 +1344,11 @@ void gpu_run(uint32_t cycles, uint32_t frame_skip)
 				 * The CPU <cannot> access OAM and VRAM during this period.
 				 */
 				case 3:
-				gpu_display();
+				/* skipped frames keep timings and interrupts,
+				 * only pixels are not produced
+				 */
+				if ( gpu_frame.skip == 0 )
+					gpu_display();
 				if ( (gpu.lcdstatus & LCDSTATUS_MODE0_HBLANK_INTERRUPT) == LCDSTATUS_MODE0_HBLANK_INTERRUPT )
 					interrupt_request(INTERRUPT_LCDSTAT);
 				mode = 0;
@@ -933,6 +1361,8 @@ void gpu_run(uint32_t cycles, uint32_t frame_skip)
 
 		gpu.lcdstatus = (gpu.lcdstatus & ~LCDSTATUS_MODE_FLAG) | mode;
 	}
+
+	return vblank;
 }
 
 void gpu_write_vram(uint16_t addr, uint8_t value)
@@ -946,12 +1376,12 @@ void gpu_write_vram(uint16_t addr, uint8_t value)
 
 	gpu.vram[addr] = value;
 
-	/* recompute only modified tile
-	 * above 0x1FFF there is the tile background map
+	/* invalidate only modified tile
+	 * above 0x17FF there is the tile background map
 	 */
 	if ( addr < 0x1800 )
 	{
-		gpu_compute_tile(addr / 16);
+		gpu_invalidate_tile(addr / 16);
 	}
 }
 
@@ -972,7 +1402,11 @@ void gpu_write_oam(uint16_t addr, uint8_t value)
 	if ( (gpu.lcdstatus & ~LCDSTATUS_MODE_FLAG) == 2 || (gpu.lcdstatus & ~LCDSTATUS_MODE_FLAG) == 3 )
 		fprintf(stderr, "invalid oam write\n");
 
+	if ( gpu.dma_cycles > 0 )
+		return;
+
 	gpu.oam[addr] = value;
+	gpu_cache.line_sprites_valid = 0;
 }
 
 uint8_t gpu_read_oam(uint16_t addr)
@@ -981,18 +1415,33 @@ uint8_t gpu_read_oam(uint16_t addr)
 
 	/* with gpu reading from OAM memory, the CPU cannot access OAM memory
 	 */
+	if ( gpu.dma_cycles > 0 )
+		return 0xFF;
+
 	return gpu.oam[addr];
 }
 
+/* transfer is done at once, then OAM stays busy
+ * for the time the real transfer takes (160 M-cycles)
+ */
 void gpu_start_dma(uint8_t value)
 {
 	uint16_t address = value * 0x100;
+	const uint8_t *page;
 	uint16_t i;
 
-	for ( i = 0; i < sizeof(gpu.oam); i++ )
+	page = mmu_get_page(value);
+	if ( page != NULL )
+		memcpy(gpu.oam, page, sizeof(gpu.oam));
+	else if ( address >= 0x8000 && address <= 0x9FFF )	/* from VRAM */
+		memcpy(gpu.oam, &gpu.vram[address - 0x8000], sizeof(gpu.oam));
+	else
 	{
-		gpu.oam[i] = mmu_read_mem8(address + i);
+		for ( i = 0; i < sizeof(gpu.oam); i++ )
+			gpu.oam[i] = mmu_read_mem8(address + i);
 	}
+	gpu_cache.line_sprites_valid = 0;
+	gpu.dma_cycles = GPU_CYCLES_DMA;
 }
 
 int32_t gpu_dump(FILE *file)
@@ -1011,14 +1460,8 @@ int32_t gpu_restore(FILE *file)
 	/* update gpu cache
 	 */
 	for ( i = 0; i < MAX_TILES; i++ )
-		gpu_compute_tile(i);
-
-	for ( i = 0; i < 4; i++)
-	{
-		gpu_cache.bgp_sdl[i] = gpu_compute_sdl_color(gpu.bgp, i);
-		gpu_cache.objpal_sdl[0][i] = gpu_compute_sdl_color(gpu.objpal[0], i);
-		gpu_cache.objpal_sdl[1][i] = gpu_compute_sdl_color(gpu.objpal[1], i);
-	}
+		gpu_invalidate_tile(i);
+	gpu_cache.line_sprites_valid = 0;
 
 	if ( (gpu.lcdctrl & LCDCTRL_LCD_ON) == 0 )
 		gpu_blank_gb_surface();
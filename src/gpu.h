@@ -16,7 +16,10 @@
 
 #define GPU_CYCLES_FULL (((GPU_CYCLES_MODE_0 + GPU_CYCLES_MODE_3 + GPU_CYCLES_MODE_2) * GB_SCREEN_HEIGHT) + (GPU_CYCLES_MODE_1 * GPU_RPT_MODE_1))
 
-int32_t gpu_init(uint32_t zoom);
+int32_t gpu_init(uint32_t zoom, uint32_t headless);
+int32_t gpu_open_screen(void);
+void gpu_show(uint32_t timeout);
+void gpu_close_screen(void);
 
 uint8_t gpu_read_ly(void);
 void gpu_write_ly(uint8_t value8);
@@ -57,7 +60,14 @@ uint8_t gpu_read_vram(uint16_t addr);
 void gpu_write_oam(uint16_t addr, uint8_t value);
 uint8_t gpu_read_oam(uint16_t addr);
 
-void gpu_run(uint32_t cycles, uint32_t frame_skip);
+uint32_t gpu_run(uint32_t cycles, uint32_t frame_skip);
+
+enum gpu_screen_format
+{
+	GPU_SCREEN_INDEX,	/* 2-bit shade indices, 0 = white ... 3 = black */
+	GPU_SCREEN_GREY,	/* grey levels, 255 = white ... 0 = black */
+};
+void gpu_copy_screen(uint8_t *dst, enum gpu_screen_format format);
 
 void gpu_start_dma(uint8_t value);
 
@@ -2,11 +2,12 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include "gboyemu.h"
 #include "interrupt.h"
 #include "z80.h"
 #include "mmu.h"
 
-static struct
+static GBOYEMU_STATE struct
 {
 	/* interrupt master flag. 0 or 1.
 	 */
@@ -1,18 +1,13 @@
 #include <stdint.h>
 #include <SDL.h>
+#include "gboyemu.h"
 #include "joypad.h"
 #include "interrupt.h"
 
-static struct
+static GBOYEMU_STATE struct
 {
-#define JOYPAD_KEY_A      0x01
-#define JOYPAD_KEY_B      0x02
-#define JOYPAD_KEY_UP     0x04
-#define JOYPAD_KEY_DOWN   0x08
-#define JOYPAD_KEY_LEFT   0x10
-#define JOYPAD_KEY_RIGHT  0x20
-#define JOYPAD_KEY_START  0x40
-#define JOYPAD_KEY_SELECT 0x80
+	/* JOYPAD_KEY_* bits
+	 */
 	uint32_t host_keys;
 
 #define REGISTER_DIRECTION_KEYS 0x10
@@ -67,46 +62,48 @@ uint8_t joypad_get(void)
 	return value;
 }
 
-uint32_t joypad_handle_key(uint16_t sdlkey, uint32_t keydown)
+/* return JOYPAD_KEY_* bit mapped to SDL key, 0 if none
+ */
+uint32_t joypad_sdl_key(uint16_t sdlkey)
 {
-	uint32_t key;
 	switch ( sdlkey )
 	{
 		case SDLK_a:
-		key = JOYPAD_KEY_A;
-		break;
+		return JOYPAD_KEY_A;
 
 		case SDLK_z:
-		key = JOYPAD_KEY_B;
-		break;
+		return JOYPAD_KEY_B;
 
 		case SDLK_UP:
-		key = JOYPAD_KEY_UP;
-		break;
+		return JOYPAD_KEY_UP;
 
 		case SDLK_DOWN:
-		key = JOYPAD_KEY_DOWN;
-		break;
+		return JOYPAD_KEY_DOWN;
 
 		case SDLK_LEFT:
-		key = JOYPAD_KEY_LEFT;
-		break;
+		return JOYPAD_KEY_LEFT;
 
 		case SDLK_RIGHT:
-		key = JOYPAD_KEY_RIGHT;
-		break;
+		return JOYPAD_KEY_RIGHT;
 
 		case SDLK_RETURN:
-		key = JOYPAD_KEY_START;
-		break;
+		return JOYPAD_KEY_START;
 
 		case SDLK_BACKSPACE:
-		key = JOYPAD_KEY_SELECT;
-		break;
+		return JOYPAD_KEY_SELECT;
 
 		default:
 		return 0;
 	}
+}
+
+uint32_t joypad_handle_key(uint16_t sdlkey, uint32_t keydown)
+{
+	uint32_t key;
+
+	key = joypad_sdl_key(sdlkey);
+	if ( key == 0 )
+		return 0;
 
 	if ( keydown )
 		joypad.host_keys |= key;
@@ -118,6 +115,24 @@ uint32_t joypad_handle_key(uint16_t sdlkey, uint32_t keydown)
 	return 1;
 }
 
+/* set all host keys at once (programmatic input).
+ * return 1 if at least one key has been newly pressed.
+ */
+uint32_t joypad_set_keys(uint32_t keys)
+{
+	uint32_t pressed;
+
+	if ( keys == joypad.host_keys )
+		return 0;
+
+	pressed = keys & ~joypad.host_keys;
+	joypad.host_keys = keys;
+
+	interrupt_request(INTERRUPT_JOYPAD);
+
+	return (pressed != 0);
+}
+
 int32_t joypad_dump(FILE *file)
 {
 	if ( fwrite(&joypad, 1, sizeof(joypad), file) != sizeof(joypad) )
@@ -3,10 +3,23 @@
 
 int32_t joypad_init(void);
 
+/* host keys
+ */
+#define JOYPAD_KEY_A      0x01
+#define JOYPAD_KEY_B      0x02
+#define JOYPAD_KEY_UP     0x04
+#define JOYPAD_KEY_DOWN   0x08
+#define JOYPAD_KEY_LEFT   0x10
+#define JOYPAD_KEY_RIGHT  0x20
+#define JOYPAD_KEY_START  0x40
+#define JOYPAD_KEY_SELECT 0x80
+
 uint8_t joypad_get(void);
 void joypad_set(uint8_t value);
 
+uint32_t joypad_sdl_key(uint16_t sdlkey);
 uint32_t joypad_handle_key(uint16_t sdlkey, uint32_t keydown);
+uint32_t joypad_set_keys(uint32_t keys);
 
 int32_t joypad_dump(FILE *file);
 int32_t joypad_restore(FILE *file);
@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "lfsr.h"
 
 uint8_t lfsr7_table[127];
 uint8_t lfsr15_table[32767];
 
-void lfsr_init(void)
+static pthread_once_t lfsr_once = PTHREAD_ONCE_INIT;
+
+static void lfsr_build_tables(void)
 {
 	uint32_t i;
 	uint16_t value, high_bit;
@@ -26,3 +29,8 @@ void lfsr_init(void)
 		value = (high_bit << 14) | (value >> 1);
 	}
 }
+
+void lfsr_init(void)
+{
+	pthread_once(&lfsr_once, lfsr_build_tables);
+}
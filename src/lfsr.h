@@ -1,6 +1,8 @@
 #ifndef _LFSR_H_
 #define _LFSR_H_
 
+/* constant tables, shared by all threads
+ */
 extern uint8_t lfsr7_table[127];
 extern uint8_t lfsr15_table[32767];
 
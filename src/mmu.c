@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include "gboyemu.h"
 #include "rom.h"
 #include "mmu.h"
 #include "gpu.h"
@@ -141,8 +142,8 @@ static uint8_t bios[256] =
 	0xF5, 0x06, 0x19, 0x78, 0x86, 0x23, 0x05, 0x20, 0xFB, 0x86, 0x20, 0xFE, 0x3E, 0x01, 0xE0, 0x50
 };
 
-static uint32_t run_bios;
-static struct
+static GBOYEMU_STATE uint32_t run_bios;
+static GBOYEMU_STATE struct
 {
 	uint8_t work_ram[0x2000];
 	uint8_t io[0x80];
@@ -511,6 +512,29 @@ uint16_t mmu_read_mem16(uint16_t addr)
 }
 
 
+/* 256 bytes starting at page * 0x100 when they are plain memory,
+ * NULL when they must be read one by one with mmu_read_mem8
+ */
+const uint8_t *mmu_get_page(uint8_t page)
+{
+	uint16_t addr = page * 0x100;
+
+	if ( run_bios && addr < 0x100 )
+		return NULL;
+	if ( addr <= 0x7FFF )
+		return rom_get_rom_page(addr);
+	else if ( addr <= 0x9FFF )
+		return NULL;
+	else if ( addr <= 0xBFFF )
+		return rom_get_ram_page(addr - 0xA000);
+	else if ( addr <= 0xDFFF )
+		return &mem.work_ram[addr - 0xC000];
+	else if ( addr <= 0xFDFF )
+		return &mem.work_ram[addr - 0xE000];
+	else
+		return NULL;
+}
+
 void mmu_write_mem8(uint16_t addr, uint8_t value8)
 {
 	if ( addr <= 0x7FFF )
@@ -574,6 +598,10 @@ void mmu_write_mem8(uint16_t addr, uint8_t value8)
 			/* DIV - Divider Register
 			 */
 			case 0xFF04:
+			/* sound frame sequencer follows divider:
+			 * catch up before it is reset
+			 */
+			sound_sync();
 			divider_set_counter(value8);
 			return;
 
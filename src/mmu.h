@@ -6,6 +6,7 @@ int32_t mmu_dump_bios(const char *filename);
 
 uint8_t mmu_read_mem8(uint16_t addr);
 uint16_t mmu_read_mem16(uint16_t addr);
+const uint8_t *mmu_get_page(uint8_t page);
 
 void mmu_write_mem8(uint16_t addr, uint8_t value8);
 void mmu_write_mem16(uint16_t addr, uint16_t value16);
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "gboyemu.h"
+#include "movie.h"
+
+#define MOVIE_TITLE_SIZE 16
+#define MOVIE_RECORD_SIZE 5
+
+static GBOYEMU_STATE struct
+{
+	FILE *file;
+	uint32_t recording;
+	uint32_t playing;
+
+	/* keys in effect: last recorded, or last played
+	 */
+	uint32_t keys;
+
+	/* next record to play
+	 */
+	uint32_t next_frame;
+	uint32_t next_keys;
+	uint32_t next_valid;
+} movie;
+
+static int32_t movie_write_record(uint32_t frame, uint32_t keys)
+{
+	uint8_t record[MOVIE_RECORD_SIZE];
+
+	record[0] = frame & 0xFF;
+	record[1] = (frame >> 8) & 0xFF;
+	record[2] = (frame >> 16) & 0xFF;
+	record[3] = (frame >> 24) & 0xFF;
+	record[4] = keys & 0xFF;
+
+	if ( fwrite(record, 1, sizeof(record), movie.file) != sizeof(record) )
+	{
+		fprintf(stderr, "Error writing movie record\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void movie_read_record(void)
+{
+	uint8_t record[MOVIE_RECORD_SIZE];
+
+	if ( fread(record, 1, sizeof(record), movie.file) != sizeof(record) )
+	{
+		movie.next_valid = 0;
+		return;
+	}
+
+	movie.next_frame = record[0] | (record[1] << 8) | (record[2] << 16) | ((uint32_t)record[3] << 24);
+	movie.next_keys = record[4];
+	movie.next_valid = 1;
+}
+
+int32_t movie_record(const char *filename, const char *title)
+{
+	uint8_t header[sizeof(MOVIE_MAGIC) - 1 + 1 + MOVIE_TITLE_SIZE];
+
+	memset(&movie, 0, sizeof(movie));
+	movie.file = fopen(filename, "wb");
+	if ( movie.file == NULL )
+	{
+		fprintf(stderr, "Could not create movie file %s\n", filename);
+		return -1;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, MOVIE_MAGIC, sizeof(MOVIE_MAGIC) - 1);
+	header[sizeof(MOVIE_MAGIC) - 1] = MOVIE_VERSION;
+	memcpy(&header[sizeof(MOVIE_MAGIC)], title, strnlen(title, MOVIE_TITLE_SIZE));
+
+	if ( fwrite(header, 1, sizeof(header), movie.file) != sizeof(header) )
+	{
+		fprintf(stderr, "Error writing movie header\n");
+		fclose(movie.file);
+		movie.file = NULL;
+		return -1;
+	}
+
+	movie.recording = 1;
+	return 0;
+}
+
+int32_t movie_play(const char *filename, const char *title)
+{
+	uint8_t header[sizeof(MOVIE_MAGIC) - 1 + 1 + MOVIE_TITLE_SIZE];
+
+	memset(&movie, 0, sizeof(movie));
+	movie.file = fopen(filename, "rb");
+	if ( movie.file == NULL )
+	{
+		fprintf(stderr, "Could not open movie file %s\n", filename);
+		return -1;
+	}
+
+	if ( fread(header, 1, sizeof(header), movie.file) != sizeof(header)
+		|| memcmp(header, MOVIE_MAGIC, sizeof(MOVIE_MAGIC) - 1) != 0
+		|| header[sizeof(MOVIE_MAGIC) - 1] != MOVIE_VERSION )
+	{
+		fprintf(stderr, "Wrong movie header\n");
+		fclose(movie.file);
+		movie.file = NULL;
+		return -1;
+	}
+
+	if ( strncmp((char *)&header[sizeof(MOVIE_MAGIC)], title, MOVIE_TITLE_SIZE) != 0 )
+		fprintf(stderr, "Warning: movie recorded with another ROM (%.16s)\n", &header[sizeof(MOVIE_MAGIC)]);
+
+	movie_read_record();
+	movie.playing = 1;
+	return 0;
+}
+
+void movie_stop(uint32_t frame)
+{
+	if ( movie.file == NULL )
+		return;
+
+	/* end of movie marker
+	 */
+	if ( movie.recording )
+		movie_write_record(frame, movie.keys);
+
+	fclose(movie.file);
+	memset(&movie, 0, sizeof(movie));
+}
+
+uint32_t movie_recording(void)
+{
+	return movie.recording;
+}
+
+uint32_t movie_playing(void)
+{
+	return movie.playing;
+}
+
+int32_t movie_frame(uint32_t frame, uint32_t *keys)
+{
+	if ( movie.recording )
+	{
+		if ( frame == 0 || *keys != movie.keys )
+		{
+			if ( movie_write_record(frame, *keys) < 0 )
+				return -1;
+			movie.keys = *keys;
+		}
+		return 0;
+	}
+
+	if ( movie.playing )
+	{
+		while ( movie.next_valid && movie.next_frame <= frame )
+		{
+			movie.keys = movie.next_keys;
+			movie_read_record();
+		}
+
+		*keys = movie.keys;
+
+		/* last record is the end marker
+		 */
+		if ( movie.next_valid == 0 )
+			return -1;
+	}
+
+	return 0;
+}
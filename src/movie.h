@@ -0,0 +1,30 @@
+#ifndef _MOVIE_H_
+#define _MOVIE_H_
+
+/* Input movie: joypad state changes stamped with the emulated
+ * frame number they apply to.
+ *
+ * file format (little endian):
+ *   header: "GBMV", version (1 byte), ROM title (16 bytes)
+ *   records: frame (4 bytes), JOYPAD_KEY_* bits (1 byte)
+ * the last record is written when recording stops and marks
+ * the end of the movie.
+ */
+
+#define MOVIE_MAGIC "GBMV"
+#define MOVIE_VERSION 1
+
+int32_t movie_record(const char *filename, const char *title);
+int32_t movie_play(const char *filename, const char *title);
+void movie_stop(uint32_t frame);
+
+uint32_t movie_recording(void);
+uint32_t movie_playing(void);
+
+/* called before frame runs, with keys from host.
+ * when playing, keys are replaced by the movie ones.
+ * return -1 once the whole movie has been played.
+ */
+int32_t movie_frame(uint32_t frame, uint32_t *keys);
+
+#endif
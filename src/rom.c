@@ -1,11 +1,19 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
+#include "gboyemu.h"
 #include "rom.h"
 
-static struct gb_rom rom;
+static GBOYEMU_STATE struct gb_rom rom;
+
+/* loaded ROM images, shared by all threads
+ */
+static pthread_mutex_t rom_images_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rom_image *rom_images;
 
 static const uint8_t scrolling_nintendo_graphics[] =
 {
@@ -14,12 +22,98 @@ static const uint8_t scrolling_nintendo_graphics[] =
 	0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
 };
 
+/* read whole ROM file, or reuse the image another
+ * instance already loaded from the same file
+ */
+static const struct rom_image *rom_image_get(const char *filename, FILE *f)
+{
+	struct rom_image *image;
+	long size;
+
+	pthread_mutex_lock(&rom_images_lock);
+
+	for ( image = rom_images; image != NULL; image = image->next )
+	{
+		if ( strcmp(image->filename, filename) == 0 )
+		{
+			image->users++;
+			pthread_mutex_unlock(&rom_images_lock);
+			return image;
+		}
+	}
+
+	image = NULL;
+	if ( fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 )
+		goto error;
+	rewind(f);
+
+	image = calloc(1, sizeof(*image));
+	if ( image == NULL )
+		goto error;
+
+	/* never smaller than a ROM only cartridge
+	 */
+	image->data = calloc(1, (size < ROM_ONLY_BANK_SIZE) ? ROM_ONLY_BANK_SIZE : size);
+	if ( image->data == NULL )
+		goto error;
+
+	if ( fread(image->data, 1, size, f) != (size_t)size )
+		goto error;
+
+	snprintf(image->filename, sizeof(image->filename), "%s", filename);
+	image->size = size;
+	image->users = 1;
+	image->next = rom_images;
+	rom_images = image;
+
+	pthread_mutex_unlock(&rom_images_lock);
+	return image;
+
+error:
+	fprintf(stderr, "Error reading ROM file %s\n", filename);
+	if ( image != NULL )
+		free(image->data);
+	free(image);
+	pthread_mutex_unlock(&rom_images_lock);
+	return NULL;
+}
+
+static void rom_image_put(const struct rom_image *image)
+{
+	struct rom_image **prev, *cur;
+
+	pthread_mutex_lock(&rom_images_lock);
+
+	for ( prev = &rom_images; (cur = *prev) != NULL; prev = &cur->next )
+	{
+		if ( cur == image )
+		{
+			if ( --cur->users == 0 )
+			{
+				*prev = cur->next;
+				free(cur->data);
+				free(cur);
+			}
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&rom_images_lock);
+}
+
+void rom_unload(void)
+{
+	if ( rom.image != NULL )
+		rom_image_put(rom.image);
+	memset(&rom, 0, sizeof(rom));
+}
+
 int32_t rom_load(const char *filename)
 {
 	FILE *f;
 	uint8_t header[0x150];
-	uint32_t i, read_count;
-	memset(&rom, 0, sizeof(rom));
+	uint32_t i;
+	rom_unload();
 
 	f = fopen(filename, "r");
 	if ( f == NULL )
@@ -161,42 +255,33 @@ int32_t rom_load(const char *filename)
 	}
 
 	fprintf(stderr, "ROM embedded RAM size: %u bytes\n", rom.ram_size);
-	rewind(f);
+
+	rom.image = rom_image_get(filename, f);
+	fclose(f);
+	if ( rom.image == NULL )
+		return -1;
 
 	switch ( rom.type )
 	{
 		case ROM_ONLY:
-		{
-			if ( fread(rom.only.bank, 1,
-					ROM_ONLY_BANK_SIZE, f) < sizeof(ROM_ONLY_BANK_SIZE) )
-			{
-				fprintf(stderr, "Error reading ROM only bank\n");
-				fclose(f);
-				return -1;
-			}
-		}
+		rom.only.bank = rom.image->data;
 		break;
 
 		case ROM_MBC1:
 		case ROM_MBC1_RAM:
 		case ROM_MBC1_RAM_BATT:
 		{
-			while ( !feof(f) )
+			rom.mbc1.rom.bank = (const uint8_t (*)[ROM_MBC1_ROM_BANK_SIZE])rom.image->data;
+			if ( rom.image->size > UINT8_MAX * ROM_MBC1_ROM_BANK_SIZE )
 			{
-				read_count = fread(&rom.mbc1.rom.bank[rom.mbc1.rom.bank_count], 1,
-					ROM_MBC1_ROM_BANK_SIZE, f);
-
-				if ( read_count == ROM_MBC1_ROM_BANK_SIZE )
-				{
-					rom.mbc1.rom.bank_count++;
-				}
-				else if ( !feof(f) )
-				{
-					fprintf(stderr, "Error reading bank #%d\n", rom.mbc1.rom.bank_count);
-					fclose(f);
-					return -1;
-				}
+				fprintf(stderr, "too many ROM banks\n");
+				rom_unload();
+				return -1;
 			}
+			/* image is at least ROM_ONLY_BANK_SIZE: two banks or more
+			 */
+			rom.mbc1.rom.bank_count = ((rom.image->size < ROM_ONLY_BANK_SIZE) ?
+				ROM_ONLY_BANK_SIZE : rom.image->size) / ROM_MBC1_ROM_BANK_SIZE;
 			fprintf(stderr, "%u ROM bank(s) each %u bytes\n", rom.mbc1.rom.bank_count, ROM_MBC1_ROM_BANK_SIZE);
 
 			if ( rom.type == ROM_MBC1_RAM || rom.type == ROM_MBC1_RAM_BATT )
@@ -235,6 +320,13 @@ static inline uint8_t rom_mbc1_bank_translate(uint8_t bank)
 	}
 }
 
+/* selected bank wraps around a smaller ROM like on hardware
+ */
+static inline uint8_t rom_mbc1_rom_bank(void)
+{
+	return rom_mbc1_bank_translate(rom.mbc1.rom.bank_cur) % rom.mbc1.rom.bank_count;
+}
+
 uint8_t rom_get_rom_bank(void)
 {
 	switch ( rom.type )
@@ -245,7 +337,7 @@ uint8_t rom_get_rom_bank(void)
 		case ROM_MBC1_RAM_BATT:
 		case ROM_MBC1_RAM:
 		case ROM_MBC1:
-		return rom_mbc1_bank_translate(rom.mbc1.rom.bank_cur);
+		return rom_mbc1_rom_bank();
 
 		default:
 		assert(0);
@@ -253,6 +345,50 @@ uint8_t rom_get_rom_bank(void)
 	}
 }
 
+/* direct access to ROM (page never crosses a bank)
+ */
+const uint8_t *rom_get_rom_page(uint16_t addr)
+{
+	uint8_t bank;
+	assert(addr <= 0x7FFF && (addr & 0xFF) == 0);
+	switch ( rom.type )
+	{
+		case ROM_ONLY:
+		return &rom.only.bank[addr];
+
+		case ROM_MBC1_RAM_BATT:
+		case ROM_MBC1_RAM:
+		case ROM_MBC1:
+		if ( addr <= 0x3FFF )
+			return &rom.mbc1.rom.bank[0][addr];
+		bank = rom_mbc1_rom_bank();
+		return &rom.mbc1.rom.bank[bank][addr - 0x4000];
+
+		default:
+		assert(0);
+		return NULL;
+	}
+}
+
+/* direct access to cartridge RAM, NULL if not readable
+ */
+const uint8_t *rom_get_ram_page(uint16_t addr)
+{
+	assert(addr <= ROM_MBC1_RAM_BANK_SIZE - 1 && (addr & 0xFF) == 0);
+	switch ( rom.type )
+	{
+		case ROM_MBC1_RAM_BATT:
+		case ROM_MBC1_RAM:
+		if ( rom.mbc1.ram.enabled == 0 )
+			return NULL;
+		assert(rom.mbc1.ram.bank_cur < rom.mbc1.ram.bank_count);
+		return &rom.mbc1.ram.bank[rom.mbc1.ram.bank_cur][addr];
+
+		default:
+		return NULL;
+	}
+}
+
 void rom_write_rom8(uint16_t addr, uint8_t value8)
 {
 	assert(addr <= 0x7FFF);
@@ -326,8 +462,7 @@ uint8_t rom_read_rom8(uint16_t addr)
 			return rom.mbc1.rom.bank[0][addr];
 		else
 		{
-			bank = rom_mbc1_bank_translate(rom.mbc1.rom.bank_cur);
-			assert(bank < rom.mbc1.rom.bank_count);
+			bank = rom_mbc1_rom_bank();
 			return rom.mbc1.rom.bank[bank][addr - 0x4000];
 		}
 		break;
@@ -405,7 +540,21 @@ int32_t rom_dump(FILE *file)
 
 int32_t rom_restore(FILE *file)
 {
+	struct gb_rom saved = rom;
+
 	if ( fread(&rom, 1, sizeof(rom), file) != sizeof(rom) )
+	{
+		rom = saved;
 		return -1;
+	}
+
+	/* ROM content is not part of the dump: keep pointing
+	 * to the loaded image
+	 */
+	rom.image = saved.image;
+	if ( rom.type == ROM_ONLY )
+		rom.only.bank = saved.only.bank;
+	else
+		rom.mbc1.rom.bank = saved.mbc1.rom.bank;
 	return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef _ROM_H_
 #define _ROM_H_
 
+#include <limits.h>
+
 enum rom_type
 {
 	ROM_ONLY,
@@ -9,17 +11,30 @@ enum rom_type
 	ROM_MBC1_RAM_BATT,
 };
 
+/* ROM file content, read-only once loaded: shared by all
+ * instances (threads) running the same ROM file
+ */
+struct rom_image
+{
+	char filename[PATH_MAX];
+	uint8_t *data;
+	uint32_t size;
+	uint32_t users;
+	struct rom_image *next;
+};
+
 struct gb_rom
 {
 	enum rom_type type;
 	char title[16];
 	uint32_t rom_size, ram_size;
+	const struct rom_image *image;
 	union
 	{
 		struct
 		{
 #define ROM_ONLY_BANK_SIZE (32 * 1024)
-			uint8_t bank[ROM_ONLY_BANK_SIZE];
+			const uint8_t *bank;
 		} only;
 		struct
 		{
@@ -32,7 +47,7 @@ struct gb_rom
 				uint8_t bank_cur;
 				uint8_t bank_count;
 #define ROM_MBC1_ROM_BANK_SIZE (16 * 1024)
-				uint8_t bank[126][ROM_MBC1_ROM_BANK_SIZE];
+				const uint8_t (*bank)[ROM_MBC1_ROM_BANK_SIZE];
 			} rom;
 			struct
 			{
@@ -47,11 +62,14 @@ struct gb_rom
 };
 
 int32_t rom_load(const char *filename);
+void rom_unload(void);
 const char *rom_get_title(void);
 
 uint8_t rom_get_rom_bank(void);
 
 uint8_t rom_read_rom8(uint16_t addr);
+const uint8_t *rom_get_rom_page(uint16_t addr);
+const uint8_t *rom_get_ram_page(uint16_t addr);
 void rom_write_rom8(uint16_t addr, uint8_t value8);
 
 uint8_t rom_read_ram8(uint16_t addr);
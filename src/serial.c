@@ -1,10 +1,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include "gboyemu.h"
 #include "serial.h"
 #include "interrupt.h"
 
-static struct
+static GBOYEMU_STATE struct
 {
 	uint8_t data;
 	uint8_t ctrl;
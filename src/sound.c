@@ -1,12 +1,15 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <SDL.h>
 #include <SDL_audio.h>
 #include "gboyemu.h"
 #include "sound.h"
+#include "divider.h"
 #include "square.h"
 #include "lfsr.h"
 #include "blip_buf.h"
@@ -15,7 +18,7 @@
 
 static uint32_t debug_sound = 0;
 
-static struct
+static GBOYEMU_STATE struct
 {
 	uint8_t NR10, NR11, NR12, NR13, NR14,
 		NR21, NR22, NR23, NR24, NR30,
@@ -27,7 +30,26 @@ static struct
 } sound;
 
 
-static SDL_AudioSpec sdl_desired, sdl_obtained;
+static GBOYEMU_STATE SDL_AudioSpec sdl_desired, sdl_obtained;
+
+/* no SDL audio device: samples are dropped (null sink)
+ * or written to a file
+ */
+#define SOUND_HEADLESS_FREQ 44100
+#define SOUND_FILE_BUFFER (64 * 1024)
+
+static GBOYEMU_STATE struct
+{
+	enum sound_sink type;
+	FILE *file;
+	/* file has a WAV header to complete on close
+	 */
+	uint32_t wav;
+	uint32_t bytes;
+	/* SDL audio device is opened
+	 */
+	uint32_t device;
+} sink;
 
 #define CH1_SWEEP_TIME	       ((sound.NR10 >> 4) & 0x7)
 #define CH1_SWEEP_DIRECTION    ((sound.NR10 >> 3) & 0x1)
@@ -85,77 +107,288 @@ static SDL_AudioSpec sdl_desired, sdl_obtained;
 
 #define CTRL_SOUND_ON	       (sound.NR52 & 0x80)
 
-struct {
+/* samples go from emulation thread (single producer) to SDL audio
+ * callback (single consumer) through a ring: no lock on either side.
+ * read and write only grow, position is taken modulo ring size.
+ */
+#define SOUND_RING_SIZE 8192	/* stereo samples, power of 2 */
+#define SOUND_RING_CHUNK 32	/* samples moved from blip at once */
+
+struct sound_ring
+{
+	int16_t samples[SOUND_RING_SIZE][2];
+	atomic_uint read, write;
+	/* samples queued when device last asked for some
+	 */
+	atomic_uint level;
+};
+
+static GBOYEMU_STATE struct sound_signal
+{
 	struct square ch1square, ch2square;
 	struct wave ch3wave;
 	struct noise ch4noise;
-	blip_t *blip_left, *blip_right;
+	/* left and right interleaved
+	 */
+	blip_t *blip;
+	struct sound_ring ring;
+	/* cycles run by the CPU since sound was last brought up to date
+	 */
+	uint32_t pending;
+	/* frame sequencer step (0-7) run on next divider edge
+	 */
+	uint8_t sequencer;
+	/* fast forward: samples are dropped, device plays silence
+	 */
+	atomic_uint muted;
+	/* ring fill (smoothed) and its target, in stereo samples
+	 */
+	struct
+	{
+		double fill;
+		double target;
+		/* accumulated correction of clocks drift
+		 */
+		double drift;
+	} rate;
 } signal;
 
 static void sound_callback(void *userdata, uint8_t *stream, int32_t len);
 
-int32_t sound_init(void)
+/* route channels to left and right outputs at master volume:
+ * only done on NR50, NR51 and NR52 writes, emitting a sample
+ * then looks gains up
+ */
+static void sound_update_mixer(void)
+{
+	const int32_t *left = square_amplitude[CTRL_LEFT_VOLUME];
+	const int32_t *right = square_amplitude[CTRL_RIGHT_VOLUME];
+
+	signal.ch1square.gain.left = (CTRL_CH1_LEFT_ON) ? left : NULL;
+	signal.ch1square.gain.right = (CTRL_CH1_RIGHT_ON) ? right : NULL;
+	signal.ch2square.gain.left = (CTRL_CH2_LEFT_ON) ? left : NULL;
+	signal.ch2square.gain.right = (CTRL_CH2_RIGHT_ON) ? right : NULL;
+	signal.ch3wave.gain.left = (CTRL_CH3_LEFT_ON) ? left : NULL;
+	signal.ch3wave.gain.right = (CTRL_CH3_RIGHT_ON) ? right : NULL;
+	signal.ch4noise.gain.left = (CTRL_CH4_LEFT_ON) ? left : NULL;
+	signal.ch4noise.gain.right = (CTRL_CH4_RIGHT_ON) ? right : NULL;
+}
+
+/* WAV header of a 16 bit stereo stream, little endian fields
+ */
+static void sound_wav_put(uint8_t *header, uint32_t offset, uint32_t value, uint32_t size)
+{
+	uint32_t i;
+	for ( i = 0; i < size; i++ )
+		header[offset + i] = (value >> (8 * i)) & 0xFF;
+}
+
+static int32_t sound_wav_header(FILE *file, uint32_t freq, uint32_t bytes)
+{
+	uint8_t header[44];
+
+	memcpy(&header[0], "RIFF", 4);
+	sound_wav_put(header, 4, 36 + bytes, 4);
+	memcpy(&header[8], "WAVEfmt ", 8);
+	sound_wav_put(header, 16, 16, 4);	/* fmt chunk size */
+	sound_wav_put(header, 20, 1, 2);	/* PCM */
+	sound_wav_put(header, 22, 2, 2);	/* channels */
+	sound_wav_put(header, 24, freq, 4);
+	sound_wav_put(header, 28, freq * 4, 4);	/* bytes per second */
+	sound_wav_put(header, 32, 4, 2);	/* bytes per frame */
+	sound_wav_put(header, 34, 16, 2);	/* bits per sample */
+	memcpy(&header[36], "data", 4);
+	sound_wav_put(header, 40, bytes, 4);
+
+	if ( fwrite(header, 1, sizeof(header), file) != sizeof(header) )
+		return -1;
+	return 0;
+}
+
+static int32_t sound_file_open(const char *filename)
+{
+	size_t len = strlen(filename);
+
+	sink.file = fopen(filename, "wb");
+	if ( sink.file == NULL )
+	{
+		fprintf(stderr, "Could not open audio file %s\n", filename);
+		return -1;
+	}
+	setvbuf(sink.file, NULL, _IOFBF, SOUND_FILE_BUFFER);
+
+	/* header is written again with sizes on close
+	 */
+	sink.wav = (len >= 4 && strcasecmp(filename + len - 4, ".wav") == 0);
+	sink.bytes = 0;
+	if ( sink.wav && sound_wav_header(sink.file, SOUND_HEADLESS_FREQ, 0) < 0 )
+	{
+		fprintf(stderr, "Could not write audio file %s\n", filename);
+		fclose(sink.file);
+		sink.file = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* move samples available in blip buffer to the file,
+ * as signed 16 bit little endian stereo
+ */
+static void sound_file_write(void)
+{
+	int16_t samples[SOUND_RING_CHUNK * 16][2];
+	uint32_t count;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	uint32_t i;
+#endif
+
+	while ( (count = blip_read_samples_stereo(signal.blip, samples[0],
+			sizeof(samples) / sizeof(samples[0]))) > 0 )
+	{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		for ( i = 0; i < count; i++ )
+		{
+			samples[i][0] = __builtin_bswap16(samples[i][0]);
+			samples[i][1] = __builtin_bswap16(samples[i][1]);
+		}
+#endif
+		if ( fwrite(samples, sizeof(samples[0]), count, sink.file) != count )
+		{
+			fprintf(stderr, "Could not write audio file, capture stopped\n");
+			sink.type = SOUND_SINK_NULL;
+			return;
+		}
+		sink.bytes += count * sizeof(samples[0]);
+	}
+}
+
+static void sound_file_close(void)
+{
+	if ( sink.file == NULL )
+		return;
+
+	/* nothing to drain if blip buffer could not be created,
+	 * nor after a write error: header still covers bytes written
+	 */
+	if ( signal.blip != NULL && sink.type == SOUND_SINK_FILE )
+		sound_file_write();
+	if ( sink.wav )
+	{
+		if ( fseek(sink.file, 0, SEEK_SET) != 0
+			|| sound_wav_header(sink.file, SOUND_HEADLESS_FREQ, sink.bytes) < 0 )
+			fprintf(stderr, "Could not complete WAV header\n");
+	}
+	fclose(sink.file);
+	sink.file = NULL;
+}
+
+int32_t sound_init(enum sound_sink type, const char *filename)
 {
 	memset(&sound, 0, sizeof(sound));
 	memset(&signal, 0, sizeof(signal));
+	memset(&sink, 0, sizeof(sink));
+	sink.type = type;
 
 	lfsr_init();
+	square_init_tables();
 
 	square_init(&signal.ch1square, 1);
 	square_init(&signal.ch2square, 2);
 	wave_init(&signal.ch3wave, sound.wavepattern, WAVEPATTERN_SIZE*2, 3);
 	noise_init(&signal.ch4noise, 4);
+	sound_update_mixer();
 
-	sdl_desired.freq = 44100;
-	sdl_desired.format = AUDIO_S16SYS;
-	sdl_desired.channels = 2;
-	sdl_desired.samples = 2048;
-	sdl_desired.callback = sound_callback;
-	sdl_desired.userdata = NULL;
-
-	if ( SDL_OpenAudio(&sdl_desired, &sdl_obtained) < 0 )
+	if ( sink.type != SOUND_SINK_SDL )
 	{
-		fprintf(stderr, "Couldn't open audio: %s\n", SDL_GetError());
-		return -1;
+		memset(&sdl_obtained, 0, sizeof(sdl_obtained));
+		sdl_obtained.freq = SOUND_HEADLESS_FREQ;
+		if ( sink.type == SOUND_SINK_FILE && sound_file_open(filename) < 0 )
+			return -1;
+	}
+	else
+	{
+		sdl_desired.freq = 44100;
+		sdl_desired.format = AUDIO_S16SYS;
+		sdl_desired.channels = 2;
+		sdl_desired.samples = 256;
+		sdl_desired.callback = sound_callback;
+		/* callback runs in SDL audio thread: give it
+		 * this thread's signal
+		 */
+		sdl_desired.userdata = &signal;
+
+		if ( SDL_OpenAudio(&sdl_desired, &sdl_obtained) < 0 )
+		{
+			fprintf(stderr, "Couldn't open audio: %s\n", SDL_GetError());
+			return -1;
+		}
+		sink.device = 1;
 	}
 
-	signal.blip_left = blip_new(sdl_obtained.freq / 10);
-	if ( signal.blip_left == NULL )
-		return -1;
-	blip_set_rates(signal.blip_left, CLOCK_SPEED_HZ, sdl_obtained.freq);
-
-	signal.blip_right = blip_new(sdl_obtained.freq / 10);
-	if ( signal.blip_right == NULL )
+	signal.blip = blip_new_stereo(sdl_obtained.freq / 10);
+	if ( signal.blip == NULL )
 	{
-		blip_delete(signal.blip_left);
+		sound_file_close();
 		return -1;
 	}
-	blip_set_rates(signal.blip_right, CLOCK_SPEED_HZ, sdl_obtained.freq);
+	blip_set_rates(signal.blip, CLOCK_SPEED_HZ, sdl_obtained.freq);
+
+	/* a frame worth of samples is produced at once, then the
+	 * emulator sleeps: on average ring holds a frame plus two device
+	 * buffers, so that it does not drain before next frame
+	 */
+	signal.rate.target = sdl_obtained.freq / 60 + 2 * sdl_obtained.samples;
+	signal.rate.fill = signal.rate.target;
 
 	fprintf(stderr, "Audio: freq=%u samples=%u\n", sdl_obtained.freq, sdl_obtained.samples);
 	return 0;
 }
 
-void sound_start(void)
+void sound_cleanup(void)
 {
-	SDL_PauseAudio(0);
+	/* callback is given this thread's signal: it must be
+	 * done with it before the thread goes away
+	 */
+	if ( sink.device )
+	{
+		SDL_CloseAudio();
+		sink.device = 0;
+	}
+
+	/* flush cycles run since last sync
+	 */
+	if ( sink.file != NULL )
+	{
+		sound_sync();
+		sound_file_close();
+	}
+	blip_delete(signal.blip);
+	signal.blip = NULL;
 }
 
-void sound_stop(void)
+void sound_start(void)
 {
-	SDL_PauseAudio(1);
+	if ( sink.type == SOUND_SINK_SDL )
+		SDL_PauseAudio(0);
 }
 
-int32_t sound_adjust_left_sample_volume(int32_t sample)
+void sound_stop(void)
 {
-	assert(CTRL_LEFT_VOLUME <= 7);
-	return (sample / 7) * CTRL_LEFT_VOLUME;
+	if ( sink.type == SOUND_SINK_SDL )
+		SDL_PauseAudio(1);
 }
 
-int32_t sound_adjust_right_sample_volume(int32_t sample)
+void sound_mute(uint32_t mute)
 {
-	assert(CTRL_RIGHT_VOLUME <= 7);
-	return (sample / 7) * CTRL_RIGHT_VOLUME;
+	/* ring is emptied by the callback while muted.
+	 * file gets every sample: keep its filter state
+	 */
+	atomic_store(&signal.muted, mute);
+	if ( sink.type == SOUND_SINK_FILE )
+		return;
+	blip_clear(signal.blip);
+	signal.rate.fill = signal.rate.target;
 }
 
 uint8_t sound_adjust_wave_sample_volume(uint8_t wave_sample)
@@ -186,233 +419,400 @@ uint8_t sound_adjust_wave_sample_volume(uint8_t wave_sample)
 	return wave_sample;
 }
 
-uint32_t sound_channel_left_is_on(uint32_t channel)
+void sound_sweep_shadow(struct square *s)
 {
-	switch ( channel )
-	{
-		case 1:
-		return CTRL_CH1_LEFT_ON;
+	CH1_WRITE_FREQUENCY(s->sweep.shadow_freq);
+	assert(CH1_FREQUENCY == s->sweep.shadow_freq);
 
-		case 2:
-		return CTRL_CH2_LEFT_ON;
+	s->period.tot_clocks = (2048 - s->sweep.shadow_freq) * 4;
+	square_sweep_shadow(s);
+}
 
-		case 3:
-		return CTRL_CH3_LEFT_ON;
+void sound_channel_set_readonly_register_status(uint32_t channel, uint8_t on)
+{
+	assert(channel >= 1 && channel <= 4);
+	if ( on )
+		sound.NR52 |= (1 << (channel - 1));
+	else
+		sound.NR52 &= ~(1 << (channel - 1));
+}
+
+static void sound_callback(void *userdata, uint8_t *stream, int32_t len)
+{
+	struct sound_signal *sig = userdata;
+	struct sound_ring *ring = &sig->ring;
+	int16_t (*buffer)[2] = (int16_t (*)[2])stream;
+	uint32_t count = len / (sizeof(int16_t) * 2);
+	uint32_t read, write, n, pos, chunk;
+
+	read = atomic_load_explicit(&ring->read, memory_order_relaxed);
+	write = atomic_load_explicit(&ring->write, memory_order_acquire);
+	atomic_store_explicit(&ring->level, write - read, memory_order_relaxed);
+
+	if ( atomic_load_explicit(&sig->muted, memory_order_relaxed) )
+	{
+		memset(stream, 0, len);
+		atomic_store_explicit(&ring->read, write, memory_order_release);
+		return;
+	}
 
-		case 4:
-		return CTRL_CH4_LEFT_ON;
+	n = write - read;
+	if ( n > count )
+		n = count;
 
-		default:
-		assert(0);
-		return 0;
+	for ( pos = 0; pos < n; pos += chunk )
+	{
+		chunk = SOUND_RING_SIZE - ((read + pos) & (SOUND_RING_SIZE - 1));
+		if ( chunk > n - pos )
+			chunk = n - pos;
+		memcpy(buffer[pos], ring->samples[(read + pos) & (SOUND_RING_SIZE - 1)],
+			chunk * sizeof(ring->samples[0]));
 	}
+
+	/* underrun: play silence
+	 */
+	if ( n < count )
+		memset(buffer[n], 0, (count - n) * sizeof(buffer[0]));
+
+	atomic_store_explicit(&ring->read, read + n, memory_order_release);
 }
 
-uint32_t sound_channel_right_is_on(uint32_t channel)
+/* move samples available in blip buffer to the ring,
+ * dropping those that do not fit
+ */
+static void sound_ring_fill(struct sound_ring *ring)
 {
-	switch ( channel )
-	{
-		case 1:
-		return CTRL_CH1_RIGHT_ON;
+	int16_t drop[SOUND_RING_CHUNK][2];
+	uint32_t read, write, count, chunk;
 
-		case 2:
-		return CTRL_CH2_RIGHT_ON;
+	write = atomic_load_explicit(&ring->write, memory_order_relaxed);
+	read = atomic_load_explicit(&ring->read, memory_order_acquire);
 
-		case 3:
-		return CTRL_CH3_RIGHT_ON;
+	count = blip_samples_avail(signal.blip);
+	while ( count > 0 && write - read < SOUND_RING_SIZE )
+	{
+		chunk = SOUND_RING_SIZE - (write & (SOUND_RING_SIZE - 1));
+		if ( chunk > SOUND_RING_SIZE - (write - read) )
+			chunk = SOUND_RING_SIZE - (write - read);
+		if ( chunk > count )
+			chunk = count;
+
+		blip_read_samples_stereo(signal.blip, ring->samples[write & (SOUND_RING_SIZE - 1)], chunk);
+		write += chunk;
+		count -= chunk;
+	}
 
-		case 4:
-		return CTRL_CH4_RIGHT_ON;
+	atomic_store_explicit(&ring->write, write, memory_order_release);
 
-		default:
-		assert(0);
-		return 0;
+	while ( count > 0 )
+	{
+		chunk = (count > SOUND_RING_CHUNK) ? SOUND_RING_CHUNK : count;
+		blip_read_samples_stereo(signal.blip, drop[0], chunk);
+		count -= chunk;
 	}
 }
 
-void sound_sweep_shadow(struct square *s)
+/* dynamic rate control: emulation is paced on system ticks, not on
+ * the audio device clock, so both drift apart. resampling ratio is
+ * nudged by at most SOUND_RATE_ADJUST to keep ring fill, as seen by
+ * the device, on target: proportionally to fill error, plus a slowly
+ * accumulated part that absorbs a steady drift.
+ */
+#define SOUND_RATE_ADJUST 0.005
+#define SOUND_RATE_SMOOTH 16
+#define SOUND_RATE_INTEGRAL 1024
+
+static inline double sound_clamp_rate(double adjust)
 {
-	CH1_WRITE_FREQUENCY(s->sweep.shadow_freq);
-	assert(CH1_FREQUENCY == s->sweep.shadow_freq);
+	if ( adjust > SOUND_RATE_ADJUST )
+		return SOUND_RATE_ADJUST;
+	if ( adjust < -SOUND_RATE_ADJUST )
+		return -SOUND_RATE_ADJUST;
+	return adjust;
+}
 
-	s->period.tot_clocks = (2048 - s->sweep.shadow_freq) * 4;
-	square_sweep_shadow(s);
+static void sound_adjust_rate(void)
+{
+	double error;
+	uint32_t level;
+
+	level = atomic_load_explicit(&signal.ring.level, memory_order_relaxed);
+	signal.rate.fill += (level - signal.rate.fill) / SOUND_RATE_SMOOTH;
+	error = SOUND_RATE_ADJUST * (signal.rate.target - signal.rate.fill) / signal.rate.target;
+	signal.rate.drift = sound_clamp_rate(signal.rate.drift + error / SOUND_RATE_INTEGRAL);
+
+	blip_set_rates(signal.blip, CLOCK_SPEED_HZ,
+		sdl_obtained.freq * (1.0 + sound_clamp_rate(error + signal.rate.drift)));
 }
 
-void sound_channel_set_readonly_register_status(uint32_t channel, uint8_t on)
+static void sound_run_channels(uint32_t time, uint32_t clocks)
 {
-	assert(channel >= 1 && channel <= 4);
-	if ( on )
-		sound.NR52 |= (1 << (channel - 1));
-	else
-		sound.NR52 &= ~(1 << (channel - 1));
+	square_run(&signal.ch1square, signal.blip, time, clocks);
+	square_run(&signal.ch2square, signal.blip, time, clocks);
+	if ( CH3_SOUND_ON )
+		wave_run(&signal.ch3wave, signal.blip, time, clocks);
+	noise_run(&signal.ch4noise, signal.blip, time, clocks);
 }
 
-static void sound_callback(void *userdata, uint8_t *stream, int32_t len)
+/* frame sequencer: length on even steps (256 Hz), sweep
+ * on steps 2 and 6 (128 Hz), envelope on step 7 (64 Hz)
+ */
+static void sound_sequencer_step(void)
 {
-	int16_t *buffer = (int16_t *)stream;
-	uint32_t count = len / (sizeof(int16_t) * 2);
-	/* int32_t missing; */
-	/* uint32_t clocks; */
+	uint8_t step = signal.sequencer;
 
-	/* missing = count - blip_samples_avail(signal.blip_left); */
-	/* if ( missing > 0 ) */
-	/* { */
-	/* 	clocks = blip_clocks_needed(signal.blip_left, missing); */
-	/* 	fprintf(stderr, "left: missing %u clocks\n", clocks); */
-	/* } */
+	signal.sequencer = (step + 1) % 8;
 
-	/* missing = count - blip_samples_avail(signal.blip_right); */
-	/* if ( missing > 0 ) */
-	/* { */
-	/* 	clocks = blip_clocks_needed(signal.blip_right, missing); */
-	/* 	fprintf(stderr, "right: missing %u clocks\n", clocks); */
-	/* } */
+	if ( (step % 2) == 0 )
+	{
+		square_length_step(&signal.ch1square);
+		square_length_step(&signal.ch2square);
+		if ( CH3_SOUND_ON )
+			wave_length_step(&signal.ch3wave);
+		noise_length_step(&signal.ch4noise);
+	}
+
+	if ( step == 2 || step == 6 )
+		square_sweep_step(&signal.ch1square);
 
-	blip_read_samples(signal.blip_left, buffer, count, 1);
-	blip_read_samples(signal.blip_right, buffer + 1, count, 1);
+	if ( step == 7 )
+	{
+		square_envelope_step(&signal.ch1square);
+		square_envelope_step(&signal.ch2square);
+		noise_envelope_step(&signal.ch4noise);
+	}
 }
 
-void sound_run(uint32_t cycles)
+/* nothing to run: APU is powered off or all channels are disabled
+ */
+static inline uint32_t sound_is_idle(void)
 {
+	if ( CTRL_SOUND_ON == 0 )
+		return 1;
+	return signal.ch1square.is_disabled && signal.ch2square.is_disabled
+		&& (signal.ch3wave.is_disabled || CH3_SOUND_ON == 0)
+		&& signal.ch4noise.is_disabled;
+}
 
-	SDL_LockAudio();
+/* catch up with CPU: run channels for all pending cycles at once,
+ * stopping on each frame sequencer edge met on the way
+ */
+void sound_sync(void)
+{
+	uint32_t cycles = signal.pending;
+	uint32_t time, edge;
 
-	square_run(&signal.ch1square, signal.blip_left, signal.blip_right, cycles);
-	square_run(&signal.ch2square, signal.blip_left, signal.blip_right, cycles);
-	if ( CH3_SOUND_ON )
-		wave_run(&signal.ch3wave, signal.blip_left, signal.blip_right, cycles);
-	noise_run(&signal.ch4noise, signal.blip_left, signal.blip_right, cycles);
+	if ( cycles == 0 )
+		return;
+	signal.pending = 0;
 
-	blip_end_frame(signal.blip_left, cycles);
-	blip_end_frame(signal.blip_right, cycles);
+	/* divider is already up to date: first edge
+	 * within pending cycles, in ]0, DIVIDER_SEQUENCER_CYCLES]
+	 */
+	edge = (cycles + divider_sequencer_cycles() - 1) % DIVIDER_SEQUENCER_CYCLES + 1;
+	if ( sound_is_idle() )
+	{
+		/* channels have nothing to output: only keep frame
+		 * sequencer in step (it is stopped while powered off)
+		 */
+		if ( CTRL_SOUND_ON && edge <= cycles )
+		{
+			signal.sequencer = (signal.sequencer
+				+ (cycles - edge) / DIVIDER_SEQUENCER_CYCLES + 1) % 8;
+		}
+	}
+	else
+	{
+		for ( time = 0; edge <= cycles; edge += DIVIDER_SEQUENCER_CYCLES )
+		{
+			sound_run_channels(time, edge - time);
+			sound_sequencer_step();
+			time = edge;
+		}
+		sound_run_channels(time, cycles - time);
+	}
 
-	SDL_UnlockAudio();
+	blip_end_frame(signal.blip, cycles);
+
+	/* file is not played in real time: it gets
+	 * every sample, even when muted
+	 */
+	if ( sink.type == SOUND_SINK_FILE )
+		sound_file_write();
+	else if ( sink.type == SOUND_SINK_NULL
+		|| atomic_load_explicit(&signal.muted, memory_order_relaxed) )
+	{
+		/* nobody reads samples: drop them before buffers overflow
+		 */
+		if ( blip_samples_avail(signal.blip) >= sdl_obtained.freq / 20 )
+			blip_clear(signal.blip);
+	}
+	else if ( blip_samples_avail(signal.blip) >= SOUND_RING_CHUNK )
+	{
+		sound_ring_fill(&signal.ring);
+		sound_adjust_rate();
+	}
+}
+
+/* sound is only updated when its registers are accessed, when
+ * a frame ends (sound_sync) or when too many cycles are pending
+ */
+#define SOUND_MAX_PENDING FRAC_SECOND(32)
+
+void sound_run(uint32_t cycles)
+{
+	signal.pending += cycles;
+	if ( signal.pending >= SOUND_MAX_PENDING )
+		sound_sync();
 }
 
 uint8_t sound_read_NR10(void)
 {
+	sound_sync();
 	return sound.NR10;
 }
 
 uint8_t sound_read_NR11(void)
 {
+	sound_sync();
 	return sound.NR11;
 }
 
 uint8_t sound_read_NR12(void)
 {
+	sound_sync();
 	return sound.NR12;
 }
 
 uint8_t sound_read_NR13(void)
 {
+	sound_sync();
 	return sound.NR13;
 }
 
 uint8_t sound_read_NR14(void)
 {
+	sound_sync();
 	return sound.NR14;
 }
 
 uint8_t sound_read_NR21(void)
 {
+	sound_sync();
 	return sound.NR21;
 }
 
 uint8_t sound_read_NR22(void)
 {
+	sound_sync();
 	return sound.NR22;
 }
 
 uint8_t sound_read_NR23(void)
 {
+	sound_sync();
 	return sound.NR23;
 }
 
 uint8_t sound_read_NR24(void)
 {
+	sound_sync();
 	return sound.NR24;
 }
 
 uint8_t sound_read_NR30(void)
 {
+	sound_sync();
 	return sound.NR30;
 }
 
 uint8_t sound_read_NR31(void)
 {
+	sound_sync();
 	return sound.NR31;
 }
 
 uint8_t sound_read_NR32(void)
 {
+	sound_sync();
 	return sound.NR32;
 }
 
 uint8_t sound_read_NR33(void)
 {
+	sound_sync();
 	return sound.NR33;
 }
 
 uint8_t sound_read_NR34(void)
 {
+	sound_sync();
 	return sound.NR34;
 }
 
 uint8_t sound_read_NR41(void)
 {
+	sound_sync();
 	return sound.NR41;
 }
 
 uint8_t sound_read_NR42(void)
 {
+	sound_sync();
 	return sound.NR42;
 }
 
 uint8_t sound_read_NR43(void)
 {
+	sound_sync();
 	return sound.NR43;
 }
 
 uint8_t sound_read_NR44(void)
 {
+	sound_sync();
 	return sound.NR44;
 }
 
 uint8_t sound_read_NR50(void)
 {
+	sound_sync();
 	return sound.NR50;
 }
 
 uint8_t sound_read_NR51(void)
 {
+	sound_sync();
 	return sound.NR51;
 }
 
 uint8_t sound_read_NR52(void)
 {
+	sound_sync();
 	return sound.NR52;
 }
 
 uint8_t sound_read_wavepattern(uint8_t index)
 {
 	assert(index < WAVEPATTERN_SIZE);
+	sound_sync();
 	return sound.wavepattern[index];
 }
 
 void sound_write_NR10(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR10\n");
 	sound.NR10 = value8;
 	signal.ch1square.sweep.direction = (CH1_SWEEP_DIRECTION == 0) ? SWEEP_INC : SWEEP_DEC;
 	signal.ch1square.sweep.shift = CH1_SWEEP_SHIFT;
-	signal.ch1square.sweep.tot_clocks = CH1_SWEEP_TIME * FRAC_SECOND(128);
+	signal.ch1square.sweep.pace = CH1_SWEEP_TIME;
 }
 
 void sound_write_NR11(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR11\n");
 	sound.NR11 = value8;
@@ -422,16 +822,19 @@ void sound_write_NR11(uint8_t value8)
 
 void sound_write_NR12(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR12\n");
 	sound.NR12 = value8;
 	signal.ch1square.envelope.counter = CH1_ENVELOPE_VOLUME;
-	signal.ch1square.envelope.tot_clocks = CH1_ENVELOPE_SWEEP * FRAC_SECOND(64);
+	signal.ch1square.envelope.pace = CH1_ENVELOPE_SWEEP;
+	signal.ch1square.envelope.timer = CH1_ENVELOPE_SWEEP;
 	signal.ch1square.envelope.direction = (CH1_ENVELOPE_DIRECTION == 0) ? ENVELOPE_DEC : ENVELOPE_INC;
 }
 
 void sound_write_NR13(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR13\n");
 	sound.NR13 = value8;
@@ -440,29 +843,31 @@ void sound_write_NR13(uint8_t value8)
 
 void sound_write_NR14(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR14\n");
 	sound.NR14 = value8;
 
        	signal.ch1square.period.tot_clocks = (2048 - CH1_FREQUENCY) * 4;
 	signal.ch1square.length.stop_on_expire = CH1_SOUND_LENGTH_ON;
-	signal.ch1square.length.tot_clocks = FRAC_SECOND(64);
 	if ( CH1_TRIGGER )
 	{
 		sound_channel_set_readonly_register_status(1, 1);
 		signal.ch1square.envelope.counter = CH1_ENVELOPE_VOLUME;
+		signal.ch1square.envelope.timer = signal.ch1square.envelope.pace;
 		signal.ch1square.is_disabled = 0;
 		signal.ch1square.sweep.shadow_freq = CH1_FREQUENCY;
-		signal.ch1square.sweep.cur_clocks = 0;
+		signal.ch1square.sweep.timer = signal.ch1square.sweep.pace;
 		if ( signal.ch1square.length.counter == 0 )
 			signal.ch1square.length.counter = 64;
-		if ( signal.ch1square.sweep.shift > 0 && signal.ch1square.sweep.tot_clocks > 0 )
+		if ( signal.ch1square.sweep.shift > 0 && signal.ch1square.sweep.pace > 0 )
 			sound_sweep_shadow(&signal.ch1square);
 	}
 }
 
 void sound_write_NR21(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR21\n");
 	sound.NR21 = value8;
@@ -472,16 +877,19 @@ void sound_write_NR21(uint8_t value8)
 
 void sound_write_NR22(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR22\n");
 	sound.NR22 = value8;
 	signal.ch2square.envelope.counter = CH2_ENVELOPE_VOLUME;
-	signal.ch2square.envelope.tot_clocks = CH2_ENVELOPE_SWEEP * FRAC_SECOND(64);
+	signal.ch2square.envelope.pace = CH2_ENVELOPE_SWEEP;
+	signal.ch2square.envelope.timer = CH2_ENVELOPE_SWEEP;
 	signal.ch2square.envelope.direction = (CH2_ENVELOPE_DIRECTION == 0) ? ENVELOPE_DEC : ENVELOPE_INC;
 }
 
 void sound_write_NR23(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR23\n");
 	sound.NR23 = value8;
@@ -490,16 +898,17 @@ void sound_write_NR23(uint8_t value8)
 
 void sound_write_NR24(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR24\n");
 	sound.NR24 = value8;
 	signal.ch2square.period.tot_clocks = (2048 - CH2_FREQUENCY) * 4;
 	signal.ch2square.length.stop_on_expire = CH2_SOUND_LENGTH_ON;
-	signal.ch2square.length.tot_clocks = FRAC_SECOND(64);
 	if ( CH2_TRIGGER )
 	{
 		sound_channel_set_readonly_register_status(2, 1);
 		signal.ch2square.envelope.counter = CH2_ENVELOPE_VOLUME;
+		signal.ch2square.envelope.timer = signal.ch2square.envelope.pace;
 		signal.ch2square.is_disabled = 0;
 		if ( signal.ch2square.length.counter == 0 )
 			signal.ch2square.length.counter = 64;
@@ -508,6 +917,7 @@ void sound_write_NR24(uint8_t value8)
 
 void sound_write_NR30(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR30\n");
 	sound.NR30 = value8;
@@ -515,6 +925,7 @@ void sound_write_NR30(uint8_t value8)
 
 void sound_write_NR31(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR31\n");
 	sound.NR31 = value8;
@@ -523,6 +934,7 @@ void sound_write_NR31(uint8_t value8)
 
 void sound_write_NR32(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR32\n");
 	sound.NR32 = value8;
@@ -530,6 +942,7 @@ void sound_write_NR32(uint8_t value8)
 
 void sound_write_NR33(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR33\n");
 	sound.NR33 = value8;
@@ -538,11 +951,11 @@ void sound_write_NR33(uint8_t value8)
 
 void sound_write_NR34(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR34\n");
 	sound.NR34 = value8;
 	signal.ch3wave.length.stop_on_expire = CH3_SOUND_LENGTH_ON;
-	signal.ch3wave.length.tot_clocks = FRAC_SECOND(256);
 	signal.ch3wave.period.tot_clocks = (2048 - CH3_FREQUENCY) * 2;
 	if ( CH3_TRIGGER )
 	{
@@ -557,6 +970,7 @@ void sound_write_NR34(uint8_t value8)
 
 void sound_write_NR41(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR41\n");
 	sound.NR41 = value8;
@@ -565,16 +979,19 @@ void sound_write_NR41(uint8_t value8)
 
 void sound_write_NR42(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR42\n");
 	sound.NR42 = value8;
 	signal.ch4noise.envelope.counter = CH4_ENVELOPE_VOLUME;
-	signal.ch4noise.envelope.tot_clocks = CH4_ENVELOPE_SWEEP * FRAC_SECOND(64);
+	signal.ch4noise.envelope.pace = CH4_ENVELOPE_SWEEP;
+	signal.ch4noise.envelope.timer = CH4_ENVELOPE_SWEEP;
 	signal.ch4noise.envelope.direction = (CH4_ENVELOPE_DIRECTION == 0) ? ENVELOPE_DEC : ENVELOPE_INC;
 }
 
 void sound_write_NR43(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR43\n");
 	sound.NR43 = value8;
@@ -586,16 +1003,17 @@ void sound_write_NR43(uint8_t value8)
 
 void sound_write_NR44(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR44\n");
 	sound.NR44 = value8;
 	signal.ch4noise.length.stop_on_expire = CH4_SOUND_LENGTH_ON;
-	signal.ch4noise.length.tot_clocks = FRAC_SECOND(64);
 	if ( CH4_TRIGGER )
 	{
 		sound_channel_set_readonly_register_status(4, 1);
 		signal.ch4noise.lfsr.counter = 0;
 		signal.ch4noise.envelope.counter = CH4_ENVELOPE_VOLUME;
+		signal.ch4noise.envelope.timer = signal.ch4noise.envelope.pace;
 		signal.ch4noise.is_disabled = 0;
 		if ( signal.ch4noise.length.counter == 0 )
 			signal.ch4noise.length.counter = 64;
@@ -604,33 +1022,52 @@ void sound_write_NR44(uint8_t value8)
 
 void sound_write_NR50(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR50\n");
 	sound.NR50 = value8;
+	sound_update_mixer();
 }
 
 void sound_write_NR51(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR51\n");
 	sound.NR51 = value8;
+	sound_update_mixer();
 }
 
 void sound_write_NR52(uint8_t value8)
 {
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write NR52\n");
 	if ( (value8 & 0x80) == 0 )
 	{
+		/* power off: registers are cleared, channels
+		 * stay silent until triggered again
+		 */
 		memset(&sound, 0, sizeof(sound));
+		signal.ch1square.is_disabled = 1;
+		signal.ch2square.is_disabled = 1;
+		signal.ch3wave.is_disabled = 1;
+		signal.ch4noise.is_disabled = 1;
+		sound_update_mixer();
 	}
-	else
+	else if ( CTRL_SOUND_ON == 0 )
+	{
+		/* power on: frame sequencer restarts from step 0
+		 */
+		signal.sequencer = 0;
 		sound.NR52 |= 0x80;
+	}
 }
 
 void sound_write_wavepattern(uint8_t index, uint8_t value8)
 {
 	assert(index < WAVEPATTERN_SIZE);
+	sound_sync();
 	if ( debug_sound )
 		fprintf(stderr, "sound write wavepattern [%u]\n", index);
 	sound.wavepattern[index] = value8;
@@ -638,6 +1075,7 @@ void sound_write_wavepattern(uint8_t index, uint8_t value8)
 
 int32_t sound_dump(FILE *file)
 {
+	sound_sync();
 	if ( fwrite(&sound, 1, sizeof(sound), file) != sizeof(sound) )
 		return -1;
 	return 0;
@@ -647,5 +1085,6 @@ int32_t sound_restore(FILE *file)
 {
 	if ( fread(&sound, 1, sizeof(sound), file) != sizeof(sound) )
 		return -1;
+	sound_update_mixer();
 	return 0;
 }
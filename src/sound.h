@@ -3,17 +3,25 @@
 
 struct square;
 
-int32_t sound_init(void);
+/* where samples go: SDL audio device, nowhere, or a file
+ * (WAV if its name ends with .wav, raw signed 16 bit little
+ * endian stereo otherwise), written faster than real time
+ */
+enum sound_sink
+{
+	SOUND_SINK_SDL,
+	SOUND_SINK_NULL,
+	SOUND_SINK_FILE,
+};
+
+int32_t sound_init(enum sound_sink type, const char *filename);
+void sound_cleanup(void);
 
 void sound_run(uint32_t cycles);
+void sound_sync(void);
 void sound_start(void);
 void sound_stop(void);
-
-int32_t sound_adjust_left_sample_volume(int32_t sample);
-int32_t sound_adjust_right_sample_volume(int32_t sample);
-
-uint32_t sound_channel_left_is_on(uint32_t channel);
-uint32_t sound_channel_right_is_on(uint32_t channel);
+void sound_mute(uint32_t mute);
 
 uint8_t sound_adjust_wave_sample_volume(uint8_t wave_sample);
 
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include "square.h"
 #include "sound.h"
 #include "lfsr.h"
@@ -10,14 +11,58 @@
 #define SIGNAL0 (INT16_MIN / VOLUME_DIVIDER)
 #define SIGNAL1 (INT16_MAX / VOLUME_DIVIDER)
 
-static const int32_t waveform_data[4][8] =
+static const uint8_t waveform_data[4][8] =
 {
-	{ SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL1},
-	{ SIGNAL1, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL1},
-	{ SIGNAL1, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL0, SIGNAL1, SIGNAL1, SIGNAL1},
-	{ SIGNAL0, SIGNAL1, SIGNAL1, SIGNAL1, SIGNAL1, SIGNAL1, SIGNAL1, SIGNAL0},
+	{ 0, 0, 0, 0, 0, 0, 0, 1},
+	{ 1, 0, 0, 0, 0, 0, 0, 1},
+	{ 1, 0, 0, 0, 0, 1, 1, 1},
+	{ 0, 1, 1, 1, 1, 1, 1, 0},
 };
 
+int32_t square_amplitude[8][SQUARE_LEVELS];
+static pthread_once_t square_once = PTHREAD_ONCE_INIT;
+
+static void square_build_tables(void)
+{
+	uint32_t master, bit, volume, wave_sample;
+	int32_t sample;
+
+	for ( master = 0; master < 8; master++ )
+	{
+		for ( bit = 0; bit < 2; bit++ )
+		{
+			for ( volume = 0; volume < 16; volume++ )
+			{
+				sample = ((bit) ? SIGNAL1 : SIGNAL0) / 15 * (int32_t)volume;
+				square_amplitude[master][SQUARE_LEVEL(bit, volume)] = (sample / 7) * (int32_t)master;
+			}
+		}
+
+		for ( wave_sample = 0; wave_sample < 16; wave_sample++ )
+		{
+			sample = ((int32_t)wave_sample - 7) * 4096 / VOLUME_DIVIDER;
+			square_amplitude[master][WAVE_LEVEL(wave_sample)] = (sample / 7) * (int32_t)master;
+		}
+	}
+}
+
+void square_init_tables(void)
+{
+	pthread_once(&square_once, square_build_tables);
+}
+
+/* clocks before a counter fires (cur_clocks reaching tot_clocks),
+ * bounded by skip
+ */
+static inline uint32_t counter_skip(uint32_t skip, uint32_t cur_clocks, uint32_t tot_clocks)
+{
+	if ( cur_clocks >= tot_clocks )
+		return 0;
+	if ( tot_clocks - cur_clocks < skip )
+		return tot_clocks - cur_clocks;
+	return skip;
+}
+
 void square_init(struct square *s, uint8_t channel)
 {
 	assert(channel >= 1 && channel <= 4);
@@ -28,135 +73,133 @@ void square_init(struct square *s, uint8_t channel)
 	s->period.waveform = 2;
 
 	s->sweep.shadow_freq = 0;
-	s->sweep.cur_clocks = 0;
-	s->sweep.tot_clocks = 0;
+	s->sweep.timer = 0;
+	s->sweep.pace = 0;
 	s->sweep.direction = SWEEP_INC;
 
-	s->length.cur_clocks = 0;
-	s->length.tot_clocks = 0;
 	s->length.counter = 0;
 	s->length.stop_on_expire = 0;
 
 	s->envelope.counter = 0;
-	s->envelope.cur_clocks = 0;
-	s->envelope.tot_clocks = 0;
+	s->envelope.timer = 0;
+	s->envelope.pace = 0;
 	s->envelope.direction = ENVELOPE_INC;
 
 	s->sample.left = 0;
 	s->sample.right = 0;
 
-	s->is_disabled = 0;
+	s->gain.left = NULL;
+	s->gain.right = NULL;
+
+	/* channel is silent until triggered
+	 */
+	s->is_disabled = 1;
 	s->channel = channel;
 }
 
-static inline void square_add_delta(blip_t *blip, uint32_t clocks,
-	int32_t *cur_sample, int32_t new_sample)
+/* left and right deltas are added at once,
+ * a side not routed or not changing adds nothing
+ */
+static inline void square_output_sample(blip_t *blip, uint32_t clocks,
+	const struct square_gain *gain, uint32_t level, int32_t *sample_left, int32_t *sample_right)
 {
-	if ( new_sample != *cur_sample )
-	{
-		blip_add_delta(blip, clocks, new_sample - *cur_sample);
-		*cur_sample = new_sample;
-	}
-}
+	int32_t left = 0, right = 0;
 
-static inline void square_output_sample(uint32_t channel, blip_t *blip_left, blip_t *blip_right,
-	uint32_t clocks, int32_t sample, int32_t *sample_left, int32_t *sample_right)
-{
-	if ( sound_channel_left_is_on(channel) )
+	if ( gain->left != NULL )
 	{
-		square_add_delta(blip_left, clocks, sample_left,
-			sound_adjust_left_sample_volume(sample));
+		left = gain->left[level] - *sample_left;
+		*sample_left = gain->left[level];
 	}
-	if ( sound_channel_right_is_on(channel) )
+	if ( gain->right != NULL )
 	{
-		square_add_delta(blip_right, clocks, sample_right,
-			sound_adjust_right_sample_volume(sample));
+		right = gain->right[level] - *sample_right;
+		*sample_right = gain->right[level];
 	}
+	if ( left != 0 || right != 0 )
+		blip_add_delta_stereo(blip, clocks, left, right);
 }
 
-void square_run(struct square *s, blip_t *blip_left, blip_t *blip_right, uint32_t clocks)
+void square_run(struct square *s, blip_t *blip, uint32_t time, uint32_t clocks)
 {
-	uint32_t c;
-	int32_t sample;
+	uint32_t c, skip;
+	uint32_t level;
 
 	if ( s->is_disabled )
 		return;
 
 	for ( c = 0; c < clocks; c++ )
 	{
-		/* sweep
+		/* jump to next period edge: nothing happens in between
 		 */
-		if ( s->sweep.tot_clocks > 0 )
+		skip = counter_skip(clocks - c, s->period.cur_clocks, s->period.tot_clocks);
+		if ( skip > 0 )
 		{
-			if ( s->sweep.cur_clocks >= s->sweep.tot_clocks )
-			{
-				s->sweep.cur_clocks -= s->sweep.tot_clocks;
-				sound_sweep_shadow(s);
-				if ( s->is_disabled )
-				{
-					sound_channel_set_readonly_register_status(s->channel, 0);
-					break;
-				}
-			}
-			s->sweep.cur_clocks++;
+			s->period.cur_clocks += skip;
+			c += skip;
+			if ( c >= clocks )
+				break;
 		}
 
-		/* period
-		 */
-		if ( s->period.cur_clocks >= s->period.tot_clocks )
-		{
-			s->period.cur_clocks -= s->period.tot_clocks;
-			sample = waveform_data[s->period.waveform][s->period.counter];
-			s->period.counter = (s->period.counter + 1) % 8;
-			sample = (sample / 15) * s->envelope.counter;
-			square_output_sample(s->channel, blip_left, blip_right, c,
-				sample, &s->sample.left, &s->sample.right);
-		}
+		s->period.cur_clocks -= s->period.tot_clocks;
+		level = SQUARE_LEVEL(waveform_data[s->period.waveform][s->period.counter],
+			s->envelope.counter);
+		s->period.counter = (s->period.counter + 1) % 8;
+		square_output_sample(blip, time + c, &s->gain,
+			level, &s->sample.left, &s->sample.right);
 		s->period.cur_clocks++;
+	}
+}
 
-		/* length
+void square_length_step(struct square *s)
+{
+	if ( s->is_disabled || !s->length.stop_on_expire || s->length.counter == 0 )
+		return;
+
+	s->length.counter--;
+	if ( s->length.counter == 0 )
+	{
+		/* channel is no more active
 		 */
-		if ( s->length.stop_on_expire )
-		{
-			if ( s->length.cur_clocks >= s->length.tot_clocks )
-			{
-				s->length.cur_clocks -= s->length.tot_clocks;
-				if ( s->length.counter > 0 )
-				{
-					s->length.counter--;
-					if ( s->length.stop_on_expire && s->length.counter == 0 )
-					{
-						/* channel is no more active: exit
-						 */
-						s->is_disabled = 1;
-						sound_channel_set_readonly_register_status(s->channel, 0);
-						break;
-					}
-				}
-			}
+		s->is_disabled = 1;
+		sound_channel_set_readonly_register_status(s->channel, 0);
+	}
+}
 
-			s->length.cur_clocks++;
-		}
+void square_sweep_step(struct square *s)
+{
+	if ( s->is_disabled || s->sweep.pace == 0 )
+		return;
 
-		/* envelope
-		 */
-		if ( s->envelope.tot_clocks > 0 )
-		{
-			if ( s->envelope.cur_clocks >= s->envelope.tot_clocks )
-			{
-				assert(s->envelope.counter <= 15);
-				s->envelope.cur_clocks -= s->envelope.tot_clocks;
-				if ( s->envelope.direction == ENVELOPE_DEC && s->envelope.counter > 0 )
-				{
-					s->envelope.counter--;
-				}
-				else if ( s->envelope.direction == ENVELOPE_INC && s->envelope.counter < 15 )
-				{
-					s->envelope.counter++;
-				}
-			}
-			s->envelope.cur_clocks++;
-		}
+	if ( s->sweep.timer > 0 )
+		s->sweep.timer--;
+	if ( s->sweep.timer > 0 )
+		return;
+
+	s->sweep.timer = s->sweep.pace;
+	sound_sweep_shadow(s);
+	if ( s->is_disabled )
+		sound_channel_set_readonly_register_status(s->channel, 0);
+}
+
+void square_envelope_step(struct square *s)
+{
+	if ( s->is_disabled || s->envelope.pace == 0 )
+		return;
+
+	if ( s->envelope.timer > 0 )
+		s->envelope.timer--;
+	if ( s->envelope.timer > 0 )
+		return;
+
+	assert(s->envelope.counter <= 15);
+	s->envelope.timer = s->envelope.pace;
+	if ( s->envelope.direction == ENVELOPE_DEC && s->envelope.counter > 0 )
+	{
+		s->envelope.counter--;
+	}
+	else if ( s->envelope.direction == ENVELOPE_INC && s->envelope.counter < 15 )
+	{
+		s->envelope.counter++;
 	}
 }
 
@@ -190,7 +233,6 @@ void wave_init(struct wave *w, uint8_t *samples_buffer, uint8_t samples_count, u
 	w->period.cur_clocks = 0;
 	w->period.tot_clocks = 0;
 
-	w->length.cur_clocks = 0;
 	w->length.counter = 0;
 	w->length.stop_on_expire = 0;
 
@@ -201,14 +243,16 @@ void wave_init(struct wave *w, uint8_t *samples_buffer, uint8_t samples_count, u
 	w->sample.left = 0;
 	w->sample.right = 0;
 
+	w->gain.left = NULL;
+	w->gain.right = NULL;
+
 	w->channel = channel;
-	w->is_disabled = 0;
+	w->is_disabled = 1;
 }
 
-void wave_run(struct wave *w, blip_t *blip_left, blip_t *blip_right, uint32_t clocks)
+void wave_run(struct wave *w, blip_t *blip, uint32_t time, uint32_t clocks)
 {
-	uint32_t c;
-	int32_t sample;
+	uint32_t c, skip;
 	uint8_t wave_sample;
 
 	if ( w->is_disabled )
@@ -216,63 +260,57 @@ void wave_run(struct wave *w, blip_t *blip_left, blip_t *blip_right, uint32_t cl
 
 	for ( c = 0; c < clocks; c++ )
 	{
-		/* period
+		/* jump to next period edge
 		 */
-		if ( w->period.cur_clocks >= w->period.tot_clocks )
+		skip = counter_skip(clocks - c, w->period.cur_clocks, w->period.tot_clocks);
+		if ( skip > 0 )
 		{
-			w->period.cur_clocks -= w->period.tot_clocks;
-			if ( (w->wave.pos % 2) == 0 )
-				wave_sample = (w->wave.buffer[w->wave.pos / 2] >> 4) & 0xF;
-			else
-				wave_sample = w->wave.buffer[w->wave.pos / 2] & 0xF;
-			w->wave.pos = (w->wave.pos + 1) % w->wave.count;
-
-			wave_sample = sound_adjust_wave_sample_volume(wave_sample);
-			sample = (wave_sample - 7) * 4096 / VOLUME_DIVIDER;
-			square_output_sample(w->channel, blip_left, blip_right, c,
-				sample, &w->sample.left, &w->sample.right);
+			w->period.cur_clocks += skip;
+			c += skip;
+			if ( c >= clocks )
+				break;
 		}
-		w->period.cur_clocks++;
 
-		/* length
-		 */
-		if ( w->length.stop_on_expire )
-		{
-			if ( w->length.cur_clocks >= w->length.tot_clocks )
-			{
-				w->length.cur_clocks -= w->length.tot_clocks;
-				if ( w->length.counter > 0 )
-				{
-					w->length.counter--;
-					if ( w->length.stop_on_expire && w->length.counter == 0 )
-					{
-						/* channel is no more active: exit
-						 */
-						w->is_disabled = 1;
-						sound_channel_set_readonly_register_status(w->channel, 0);
-						break;
-					}
-				}
-			}
+		w->period.cur_clocks -= w->period.tot_clocks;
+		if ( (w->wave.pos % 2) == 0 )
+			wave_sample = (w->wave.buffer[w->wave.pos / 2] >> 4) & 0xF;
+		else
+			wave_sample = w->wave.buffer[w->wave.pos / 2] & 0xF;
+		w->wave.pos = (w->wave.pos + 1) % w->wave.count;
 
-			w->length.cur_clocks++;
-		}
+		wave_sample = sound_adjust_wave_sample_volume(wave_sample);
+		square_output_sample(blip, time + c, &w->gain,
+			WAVE_LEVEL(wave_sample), &w->sample.left, &w->sample.right);
+		w->period.cur_clocks++;
 	}
 }
 
+void wave_length_step(struct wave *w)
+{
+	if ( w->is_disabled || !w->length.stop_on_expire || w->length.counter == 0 )
+		return;
+
+	w->length.counter--;
+	if ( w->length.counter == 0 )
+	{
+		/* channel is no more active
+		 */
+		w->is_disabled = 1;
+		sound_channel_set_readonly_register_status(w->channel, 0);
+	}
+}
 
 void noise_init(struct noise *n, uint8_t channel)
 {
 	n->period.cur_clocks = 0;
 	n->period.tot_clocks = 0;
 
-	n->length.cur_clocks = 0;
 	n->length.counter = 0;
 	n->length.stop_on_expire = 0;
 
 	n->envelope.counter = 0;
-	n->envelope.cur_clocks = 0;
-	n->envelope.tot_clocks = 0;
+	n->envelope.timer = 0;
+	n->envelope.pace = 0;
 	n->envelope.direction = ENVELOPE_INC;
 
 	n->lfsr.width = LFSR7;
@@ -281,92 +319,91 @@ void noise_init(struct noise *n, uint8_t channel)
 	n->sample.left = 0;
 	n->sample.right = 0;
 
+	n->gain.left = NULL;
+	n->gain.right = NULL;
+
 	n->channel = channel;
-	n->is_disabled = 0;
+	n->is_disabled = 1;
 }
 
-void noise_run(struct noise *n, blip_t *blip_left, blip_t *blip_right, uint32_t clocks)
+void noise_run(struct noise *n, blip_t *blip, uint32_t time, uint32_t clocks)
 {
-	uint32_t c;
+	uint32_t c, skip;
 	uint8_t lfsr_bit;
-	int32_t sample;
 
 	if ( n->is_disabled )
 		return;
 
 	for ( c = 0; c < clocks; c++ )
 	{
-		/* period
+		/* jump to next period edge
 		 */
-		if ( n->period.cur_clocks >= n->period.tot_clocks )
+		skip = counter_skip(clocks - c, n->period.cur_clocks, n->period.tot_clocks);
+		if ( skip > 0 )
 		{
-			n->period.cur_clocks -= n->period.tot_clocks;
-			switch ( n->lfsr.width )
-			{
-				case LFSR7:
-				lfsr_bit = lfsr7_table[n->lfsr.counter];
-				n->lfsr.counter++;
-				if ( n->lfsr.counter >= 127 )
-					n->lfsr.counter = 0;
-				break;
-
-				case LFSR15:
-				lfsr_bit = lfsr15_table[n->lfsr.counter];
-				n->lfsr.counter++;
-				if ( n->lfsr.counter >= 32767 )
-					n->lfsr.counter = 0;
+			n->period.cur_clocks += skip;
+			c += skip;
+			if ( c >= clocks )
 				break;
-			}
+		}
 
-			sample = (lfsr_bit) ? SIGNAL1 : SIGNAL0;
-			sample = (sample / 15) * n->envelope.counter;
-			square_output_sample(n->channel, blip_left, blip_right, c,
-				sample, &n->sample.left, &n->sample.right);
+		n->period.cur_clocks -= n->period.tot_clocks;
+		switch ( n->lfsr.width )
+		{
+			case LFSR7:
+			lfsr_bit = lfsr7_table[n->lfsr.counter];
+			n->lfsr.counter++;
+			if ( n->lfsr.counter >= 127 )
+				n->lfsr.counter = 0;
+			break;
+
+			case LFSR15:
+			lfsr_bit = lfsr15_table[n->lfsr.counter];
+			n->lfsr.counter++;
+			if ( n->lfsr.counter >= 32767 )
+				n->lfsr.counter = 0;
+			break;
 		}
+
+		square_output_sample(blip, time + c, &n->gain,
+			SQUARE_LEVEL(lfsr_bit, n->envelope.counter), &n->sample.left, &n->sample.right);
 		n->period.cur_clocks++;
+	}
+}
+
+void noise_length_step(struct noise *n)
+{
+	if ( n->is_disabled || !n->length.stop_on_expire || n->length.counter == 0 )
+		return;
 
-		/* length
+	n->length.counter--;
+	if ( n->length.counter == 0 )
+	{
+		/* channel is no more active
 		 */
-		if ( n->length.stop_on_expire )
-		{
-			if ( n->length.cur_clocks >= n->length.tot_clocks )
-			{
-				n->length.cur_clocks -= n->length.tot_clocks;
-				if ( n->length.counter > 0 )
-				{
-					n->length.counter--;
-					if ( n->length.stop_on_expire && n->length.counter == 0 )
-					{
-						/* channel is no more active: exit
-						 */
-						n->is_disabled = 1;
-						sound_channel_set_readonly_register_status(n->channel, 0);
-						break;
-					}
-				}
-			}
+		n->is_disabled = 1;
+		sound_channel_set_readonly_register_status(n->channel, 0);
+	}
+}
 
-			n->length.cur_clocks++;
-		}
+void noise_envelope_step(struct noise *n)
+{
+	if ( n->is_disabled || n->envelope.pace == 0 )
+		return;
 
-		/* envelope
-		 */
-		if ( n->envelope.tot_clocks > 0 )
-		{
-			if ( n->envelope.cur_clocks >= n->envelope.tot_clocks )
-			{
-				assert(n->envelope.counter <= 15);
-				n->envelope.cur_clocks -= n->envelope.tot_clocks;
-				if ( n->envelope.direction == ENVELOPE_DEC && n->envelope.counter > 0 )
-				{
-					n->envelope.counter--;
-				}
-				else if ( n->envelope.direction == ENVELOPE_INC && n->envelope.counter < 15 )
-				{
-					n->envelope.counter++;
-				}
-			}
-			n->envelope.cur_clocks++;
-		}
+	if ( n->envelope.timer > 0 )
+		n->envelope.timer--;
+	if ( n->envelope.timer > 0 )
+		return;
+
+	assert(n->envelope.counter <= 15);
+	n->envelope.timer = n->envelope.pace;
+	if ( n->envelope.direction == ENVELOPE_DEC && n->envelope.counter > 0 )
+	{
+		n->envelope.counter--;
+	}
+	else if ( n->envelope.direction == ENVELOPE_INC && n->envelope.counter < 15 )
+	{
+		n->envelope.counter++;
 	}
 }
@@ -5,6 +5,29 @@
 
 enum envelope_dir { ENVELOPE_INC, ENVELOPE_DEC };
 
+/* output levels: square and noise channels output a 1 bit signal
+ * at envelope volume (0-15), wave channel a 4 bit sample
+ */
+#define SQUARE_LEVEL(bit, volume) (((bit) << 4) | (volume))
+#define WAVE_LEVEL(sample) (32 + (sample))
+#define SQUARE_LEVELS 48
+
+/* constant table, shared by all threads: amplitude of
+ * each level for master volume 0-7 (NR50)
+ */
+extern int32_t square_amplitude[8][SQUARE_LEVELS];
+
+void square_init_tables(void);
+
+/* square_amplitude rows of channel master volumes, NULL when
+ * channel is not routed to that side (NR51)
+ */
+struct square_gain
+{
+	const int32_t *left;
+	const int32_t *right;
+};
+
 struct square
 {
 	struct
@@ -18,16 +41,17 @@ struct square
 	struct
 	{
 		uint32_t shadow_freq;
-		uint32_t cur_clocks;
-		uint32_t tot_clocks;
+		/* frame sequencer steps (128 Hz) left before next sweep,
+		 * reloaded from pace. 0 pace: no sweep
+		 */
+		uint8_t timer;
+		uint8_t pace;
 		uint8_t shift;
 		enum { SWEEP_INC, SWEEP_DEC } direction;
 	} sweep;
 
 	struct
 	{
-		uint32_t cur_clocks;
-		uint32_t tot_clocks;
 		uint8_t counter;
 		uint8_t stop_on_expire;
 	} length;
@@ -35,8 +59,11 @@ struct square
 	struct
 	{
 		uint8_t counter;
-		uint32_t cur_clocks;
-		uint32_t tot_clocks;
+		/* frame sequencer steps (64 Hz) left before next volume
+		 * change, reloaded from pace. 0 pace: no envelope
+		 */
+		uint8_t timer;
+		uint8_t pace;
 		enum envelope_dir direction;
 	} envelope;
 
@@ -46,13 +73,21 @@ struct square
 		int32_t right;
 	} sample;
 
+	struct square_gain gain;
 	uint8_t channel;
 	uint8_t is_disabled;
 };
 
 void square_init(struct square *s, uint8_t channel);
-void square_run(struct square *s, blip_t *blip_left, blip_t *blip_right, uint32_t time_inc);
+/* channels only run their period: length, sweep and envelope
+ * are stepped by the frame sequencer (sound.c).
+ * time: blip clock of the first cycle run
+ */
+void square_run(struct square *s, blip_t *blip, uint32_t time, uint32_t clocks);
 void square_sweep_shadow(struct square *s);
+void square_length_step(struct square *s);
+void square_sweep_step(struct square *s);
+void square_envelope_step(struct square *s);
 
 struct wave
 {
@@ -64,8 +99,6 @@ struct wave
 
 	struct
 	{
-		uint32_t cur_clocks;
-		uint32_t tot_clocks;
 		uint16_t counter;
 		uint8_t stop_on_expire;
 	} length;
@@ -89,12 +122,14 @@ struct wave
 		int32_t right;
 	} sample;
 
+	struct square_gain gain;
 	uint8_t channel;
 	uint8_t is_disabled;
 };
 
 void wave_init(struct wave *w, uint8_t *samples_buffer, uint8_t samples_count, uint8_t channel);
-void wave_run(struct wave *w, blip_t *blip_left, blip_t *blip_right, uint32_t clocks);
+void wave_run(struct wave *w, blip_t *blip, uint32_t time, uint32_t clocks);
+void wave_length_step(struct wave *w);
 
 struct noise
 {
@@ -106,8 +141,6 @@ struct noise
 
 	struct
 	{
-		uint32_t cur_clocks;
-		uint32_t tot_clocks;
 		uint16_t counter;
 		uint8_t stop_on_expire;
 	} length;
@@ -115,8 +148,8 @@ struct noise
 	struct
 	{
 		uint8_t counter;
-		uint32_t cur_clocks;
-		uint32_t tot_clocks;
+		uint8_t timer;
+		uint8_t pace;
 		enum envelope_dir direction;
 	} envelope;
 
@@ -132,12 +165,15 @@ struct noise
 		int32_t right;
 	} sample;
 
+	struct square_gain gain;
 	uint8_t channel;
 	uint8_t is_disabled;
 };
 
 void noise_init(struct noise *w, uint8_t channel);
-void noise_run(struct noise *w, blip_t *blip_left, blip_t *blip_right, uint32_t clocks);
+void noise_run(struct noise *w, blip_t *blip, uint32_t time, uint32_t clocks);
+void noise_length_step(struct noise *n);
+void noise_envelope_step(struct noise *n);
 
 
 #endif
@@ -6,7 +6,7 @@
 #include "timer.h"
 #include "interrupt.h"
 
-struct
+GBOYEMU_STATE struct
 {
 	uint32_t cycles;
 	uint8_t counter;
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "gboyemu.h"
+#include "vecenv.h"
+
+enum vecenv_command
+{
+	VECENV_STEP,
+	VECENV_RESET,
+	VECENV_WATCH,
+	VECENV_HOOK,
+	VECENV_QUIT,
+};
+
+/* shared by all threads: emulator state itself is thread local,
+ * so every env_*() call has to be made by the worker owning it
+ */
+static struct
+{
+	char rom_filename[PATH_MAX];
+	uint32_t count;
+	pthread_t threads[VECENV_MAX];
+
+	/* barrier: main thread publishes a command by bumping generation,
+	 * then waits until no worker is pending
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t wake, idle;
+	uint32_t generation;
+	uint32_t pending;
+
+	/* current command and its arguments
+	 */
+	enum vecenv_command command;
+	const uint8_t *buttons;
+	const uint8_t *mask;
+	uint32_t frames;
+	enum gpu_screen_format format;
+	uint16_t watch_addr;
+	int32_t watch_weight;
+	env_reward_hook hook;
+	void *opaque;
+
+	/* per environment results
+	 */
+	uint8_t *observations;
+	int32_t status[VECENV_MAX];
+	int32_t rewards[VECENV_MAX];
+	uint32_t frames_run[VECENV_MAX];
+} vecenv;
+
+static void vecenv_execute(uint32_t i)
+{
+	switch ( vecenv.command )
+	{
+		case VECENV_STEP:
+		vecenv.frames_run[i] = env_step(vecenv.buttons[i], vecenv.frames,
+			&vecenv.observations[i * ENV_OBSERVATION_SIZE], vecenv.format,
+			&vecenv.rewards[i]);
+		break;
+
+		case VECENV_RESET:
+		if ( vecenv.mask == NULL || vecenv.mask[i] )
+			vecenv.status[i] = env_reset();
+		break;
+
+		case VECENV_WATCH:
+		vecenv.status[i] = env_watch(vecenv.watch_addr, vecenv.watch_weight);
+		break;
+
+		case VECENV_HOOK:
+		env_set_reward_hook(vecenv.hook, vecenv.opaque);
+		break;
+
+		case VECENV_QUIT:
+		env_cleanup();
+		break;
+	}
+}
+
+static void vecenv_done(void)
+{
+	pthread_mutex_lock(&vecenv.lock);
+	vecenv.pending--;
+	if ( vecenv.pending == 0 )
+		pthread_cond_signal(&vecenv.idle);
+	pthread_mutex_unlock(&vecenv.lock);
+}
+
+static void *vecenv_worker(void *arg)
+{
+	uint32_t i = (uintptr_t)arg;
+	uint32_t generation = 0;
+	enum vecenv_command command;
+
+	vecenv.status[i] = env_init(vecenv.rom_filename);
+	vecenv_done();
+
+	for ( ;; )
+	{
+		pthread_mutex_lock(&vecenv.lock);
+		while ( vecenv.generation == generation )
+			pthread_cond_wait(&vecenv.wake, &vecenv.lock);
+		generation = vecenv.generation;
+		command = vecenv.command;
+		pthread_mutex_unlock(&vecenv.lock);
+
+		vecenv_execute(i);
+		vecenv_done();
+
+		if ( command == VECENV_QUIT )
+			break;
+	}
+
+	return NULL;
+}
+
+/* wait until all workers are done with current command
+ */
+static int32_t vecenv_wait(void)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&vecenv.lock);
+	while ( vecenv.pending > 0 )
+		pthread_cond_wait(&vecenv.idle, &vecenv.lock);
+	pthread_mutex_unlock(&vecenv.lock);
+
+	for ( i = 0; i < vecenv.count; i++ )
+	{
+		if ( vecenv.status[i] < 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+static int32_t vecenv_run(enum vecenv_command command)
+{
+	memset(vecenv.status, 0, sizeof(vecenv.status));
+
+	pthread_mutex_lock(&vecenv.lock);
+	vecenv.command = command;
+	vecenv.pending = vecenv.count;
+	vecenv.generation++;
+	pthread_cond_broadcast(&vecenv.wake);
+	pthread_mutex_unlock(&vecenv.lock);
+
+	return vecenv_wait();
+}
+
+int32_t vecenv_init(const char *rom_filename, uint32_t count)
+{
+	uint32_t i;
+
+	if ( count == 0 || count > VECENV_MAX )
+	{
+		fprintf(stderr, "Invalid environments count %u\n", count);
+		return -1;
+	}
+
+	memset(&vecenv, 0, sizeof(vecenv));
+	snprintf(vecenv.rom_filename, sizeof(vecenv.rom_filename), "%s", rom_filename);
+	pthread_mutex_init(&vecenv.lock, NULL);
+	pthread_cond_init(&vecenv.wake, NULL);
+	pthread_cond_init(&vecenv.idle, NULL);
+
+	/* observations: count x ENV_OBSERVATION_SIZE, each one starting
+	 * on a cache line
+	 */
+	if ( posix_memalign((void **)&vecenv.observations, VECENV_ALIGN,
+			count * ENV_OBSERVATION_SIZE) != 0 )
+	{
+		fprintf(stderr, "Could not allocate observations buffer\n");
+		return -1;
+	}
+	memset(vecenv.observations, 0, count * ENV_OBSERVATION_SIZE);
+
+	vecenv.pending = count;
+	for ( i = 0; i < count; i++ )
+	{
+		if ( pthread_create(&vecenv.threads[i], NULL, vecenv_worker, (void *)(uintptr_t)i) != 0 )
+		{
+			fprintf(stderr, "Could not create environment thread #%u\n", i);
+			pthread_mutex_lock(&vecenv.lock);
+			vecenv.pending -= count - i;
+			pthread_mutex_unlock(&vecenv.lock);
+			vecenv.count = i;
+			vecenv_wait();
+			vecenv_cleanup();
+			return -1;
+		}
+		vecenv.count++;
+	}
+
+	if ( vecenv_wait() < 0 )
+	{
+		vecenv_cleanup();
+		return -1;
+	}
+
+	return 0;
+}
+
+void vecenv_cleanup(void)
+{
+	uint32_t i;
+
+	vecenv_run(VECENV_QUIT);
+	for ( i = 0; i < vecenv.count; i++ )
+		pthread_join(vecenv.threads[i], NULL);
+
+	free(vecenv.observations);
+	vecenv.observations = NULL;
+	vecenv.count = 0;
+
+	pthread_cond_destroy(&vecenv.idle);
+	pthread_cond_destroy(&vecenv.wake);
+	pthread_mutex_destroy(&vecenv.lock);
+}
+
+uint32_t vecenv_count(void)
+{
+	return vecenv.count;
+}
+
+uint8_t *vecenv_get_observations(void)
+{
+	return vecenv.observations;
+}
+
+int32_t *vecenv_get_rewards(void)
+{
+	return vecenv.rewards;
+}
+
+uint32_t *vecenv_get_frames(void)
+{
+	return vecenv.frames_run;
+}
+
+int32_t vecenv_watch(uint16_t addr, int32_t weight)
+{
+	vecenv.watch_addr = addr;
+	vecenv.watch_weight = weight;
+	return vecenv_run(VECENV_WATCH);
+}
+
+int32_t vecenv_set_reward_hook(env_reward_hook hook, void *opaque)
+{
+	vecenv.hook = hook;
+	vecenv.opaque = opaque;
+	return vecenv_run(VECENV_HOOK);
+}
+
+int32_t vecenv_reset(const uint8_t *mask)
+{
+	vecenv.mask = mask;
+	return vecenv_run(VECENV_RESET);
+}
+
+int32_t vecenv_step(const uint8_t *buttons, uint32_t frames, enum gpu_screen_format format)
+{
+	vecenv.buttons = buttons;
+	vecenv.frames = frames;
+	vecenv.format = format;
+	return vecenv_run(VECENV_STEP);
+}
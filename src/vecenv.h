@@ -0,0 +1,34 @@
+#ifndef _VECENV_H_
+#define _VECENV_H_
+
+#include "env.h"
+
+/* Vectorized environment: count environments stepped in lockstep,
+ * each one in its own thread. Observations of all environments are
+ * written to a single cache-aligned buffer of count x ENV_OBSERVATION_SIZE
+ * bytes (count x GB_SCREEN_HEIGHT x GB_SCREEN_WIDTH), allocated once.
+ */
+
+#define VECENV_MAX 256
+#define VECENV_ALIGN 64
+
+int32_t vecenv_init(const char *rom_filename, uint32_t count);
+void vecenv_cleanup(void);
+
+uint32_t vecenv_count(void);
+uint8_t *vecenv_get_observations(void);
+int32_t *vecenv_get_rewards(void);
+uint32_t *vecenv_get_frames(void);
+
+int32_t vecenv_watch(uint16_t addr, int32_t weight);
+int32_t vecenv_set_reward_hook(env_reward_hook hook, void *opaque);
+
+/* reset environments whose mask byte is non zero (all if mask is NULL)
+ */
+int32_t vecenv_reset(const uint8_t *mask);
+
+/* step all environments, buttons holds one JOYPAD_KEY_* byte per environment
+ */
+int32_t vecenv_step(const uint8_t *buttons, uint32_t frames, enum gpu_screen_format format);
+
+#endif
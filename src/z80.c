@@ -3,13 +3,14 @@
 #include <string.h>
 #include <assert.h>
 #include <SDL.h>
+#include "gboyemu.h"
 #include "z80.h"
 #include "mmu.h"
 #include "gpu.h"
 #include "rom.h"
 #include "interrupt.h"
 
-static struct z80_cpu z80;
+static GBOYEMU_STATE struct z80_cpu z80;
 
 static inline uint8_t Z_GET(void)
 {